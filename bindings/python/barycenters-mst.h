@@ -0,0 +1,439 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <limits>
+#include <cmath>
+#include <tuple>
+
+#include <nesoi/parallel.h>
+
+#include "barycenters.h"
+
+// Minimum spanning tree of the complete graph on the barycenters, where the edge (u,v) has the level
+// distance(u,v), at which the two balls meet. The merge tree of the sublevel sets depends only on this
+// tree, so its n-1 edges give the same persistence pairs as all the n*(n-1)/2 pairs.
+//
+// Boruvka's algorithm over a k-d tree of the barycenters: in every round, each barycenter looks for the
+// closest barycenter in another component, skipping the cells that lie inside its own component, and the
+// cells whose lower bound on the level cannot beat the best candidate found so far.
+//
+// With eps > 0, the tree is a minimum spanning tree of the levels rounded up to the powers of (1 + eps),
+// which prunes much more; every death in the merge tree is then at most (1 + eps) times too high.
+template<class T>
+class BarycentersMST
+{
+    public:
+        using Real          = T;
+        using Barycenters   = BarycentersContainer<T>;
+
+        struct Edge
+        {
+            size_t  u, v;
+            Real    level;          // distance(u,v)
+        };
+        using EdgeContainer = std::vector<Edge>;
+
+    public:
+                        BarycentersMST(const Barycenters& barycenters, Real eps = 0, unsigned threads = 0);
+
+        const EdgeContainer&
+                        edges() const                           { return edges_; }
+
+    private:
+        static constexpr size_t leaf_size   = 16;
+        static constexpr size_t none        = static_cast<size_t>(-1);
+
+        struct Node
+        {
+            size_t      b, e;           // range of order_
+            size_t      right;          // the left child follows the node; right == none for the leaves
+            Real        value;          // minimum value of the barycenters in the node
+            size_t      component;      // component of all the barycenters in the node, or none if they are mixed
+        };
+
+        struct Query
+        {
+            size_t      u, i, component;        // i is the position of u in order_
+            Real        value;
+            size_t      v;              // best candidate so far
+            Real        level;
+            Real        threshold;      // the cells that cannot get below this level are pruned
+        };
+
+        Real            value(size_t u) const                   { return -barycenters_.weight(u); }
+
+        size_t          build(size_t b, size_t e);
+        Real            sq_distance(const Query& q, size_t node) const;
+        Real            threshold(Real level) const;
+        bool            prune(const Query& q, Real lower_bound) const;
+        void            label_nodes();
+        void            search(Query& q, size_t node);
+        size_t          find(size_t u);
+
+    private:
+        const Barycenters&          barycenters_;
+        Real                        eps_;
+        unsigned                    threads_;
+
+        std::vector<size_t>         order_;
+        Barycenters                 points_;                // the barycenters in the order of the tree, so that the leaves are contiguous
+        std::vector<Node>           nodes_;
+        std::vector<Real>           lower_, upper_;         // bounding boxes of the nodes, dimension() per node
+
+        std::vector<size_t>         parent_;                // union-find over the barycenters
+        std::vector<size_t>         components_;            // root of every barycenter, for the current round
+        std::vector<std::atomic<Real>>
+                                    bounds_;                // best level found so far for every component
+
+        EdgeContainer               edges_;
+};
+
+template<class T>
+BarycentersMST<T>::
+BarycentersMST(const Barycenters& barycenters, Real eps, unsigned threads):
+    barycenters_(barycenters), eps_(eps), threads_(threads),
+    points_(barycenters.size(), barycenters.dimension())
+{
+    size_t n = barycenters_.size();
+    if (n == 0)
+        return;
+
+    order_.resize(n);
+    std::iota(order_.begin(), order_.end(), 0);
+    build(0, n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (size_t c = 0; c < barycenters_.dimension(); ++c)
+            points_.coordinate(i, c) = barycenters_.coordinate(order_[i], c);
+        points_.weight(i) = barycenters_.weight(order_[i]);
+    }
+
+    parent_.resize(n);
+    std::iota(parent_.begin(), parent_.end(), 0);
+    components_.resize(n);
+    bounds_ = std::vector<std::atomic<Real>>(n);
+
+    std::vector<Query> best(n);
+    std::vector<size_t> candidates;
+    while (edges_.size() + 1 < n)
+    {
+        for (size_t u = 0; u < n; ++u)
+            components_[u] = find(u);
+        label_nodes();
+        for (auto& b : bounds_)
+            b.store(std::numeric_limits<Real>::infinity(), std::memory_order_relaxed);
+
+        // the queries follow the order of the tree, so that consecutive queries visit the same cells
+        nesoi::for_each(n, [this,&best](size_t i)
+        {
+            size_t u = order_[i];
+            Query& q = best[u];
+            q = Query { u, i, components_[u], value(u), none, std::numeric_limits<Real>::infinity(), std::numeric_limits<Real>::infinity() };
+            search(q, 0);
+        }, threads_);
+
+        // the best edge out of every component; ties are broken by the endpoints, so the result is deterministic
+        auto better = [](const Query& x, const Query& y)
+                      {
+                          return std::make_tuple(x.level, std::min(x.u, x.v), std::max(x.u, x.v)) <
+                                 std::make_tuple(y.level, std::min(y.u, y.v), std::max(y.u, y.v));
+                      };
+        for (size_t u = 0; u < n; ++u)
+        {
+            size_t c = components_[u];
+            if (u != c && best[u].v != none && (best[c].v == none || better(best[u], best[c])))
+                best[c] = best[u];
+        }
+
+        candidates.clear();
+        for (size_t c = 0; c < n; ++c)
+            if (components_[c] == c && best[c].v != none)
+                candidates.push_back(c);
+        std::sort(candidates.begin(), candidates.end(),
+                  [&best,&better](size_t c, size_t d) { return better(best[c], best[d]); });
+
+        size_t added = 0;
+        for (size_t c : candidates)
+        {
+            size_t u = find(best[c].u), v = find(best[c].v);
+            if (u == v)                         // the same edge, or a cycle of equal levels
+                continue;
+            parent_[u] = v;
+            edges_.push_back(Edge { best[c].u, best[c].v, best[c].level });
+            ++added;
+        }
+
+        if (added == 0)
+            break;
+    }
+}
+
+// nodes in preorder; returns the index of the node
+template<class T>
+size_t
+BarycentersMST<T>::
+build(size_t b, size_t e)
+{
+    size_t dim  = barycenters_.dimension();
+    size_t node = nodes_.size();
+    nodes_.push_back(Node { b, e, none, std::numeric_limits<Real>::infinity(), none });
+    lower_.resize(lower_.size() + dim,  std::numeric_limits<Real>::infinity());
+    upper_.resize(upper_.size() + dim, -std::numeric_limits<Real>::infinity());
+
+    Real* lower = &lower_[node * dim];
+    Real* upper = &upper_[node * dim];
+    Real  value = std::numeric_limits<Real>::infinity();
+    for (size_t j = b; j < e; ++j)
+    {
+        size_t u = order_[j];
+        for (size_t c = 0; c < dim; ++c)
+        {
+            lower[c] = std::min(lower[c], barycenters_.coordinate(u,c));
+            upper[c] = std::max(upper[c], barycenters_.coordinate(u,c));
+        }
+        value = std::min(value, this->value(u));
+    }
+    nodes_[node].value = value;
+
+    if (e - b <= leaf_size)
+        return node;
+
+    // split the widest axis at the median
+    size_t axis = 0;
+    for (size_t c = 1; c < dim; ++c)
+        if (upper[c] - lower[c] > upper[axis] - lower[axis])
+            axis = c;
+
+    size_t m = b + (e - b)/2;
+    std::nth_element(order_.begin() + b, order_.begin() + m, order_.begin() + e,
+                     [this,axis](size_t u, size_t v) { return barycenters_.coordinate(u,axis) < barycenters_.coordinate(v,axis); });
+
+    build(b, m);
+    size_t right = build(m, e);
+    nodes_[node].right = right;
+    return node;
+}
+
+template<class T>
+typename BarycentersMST<T>::Real
+BarycentersMST<T>::
+sq_distance(const Query& q, size_t node) const
+{
+    size_t      dim   = barycenters_.dimension();
+    const Real* lower = &lower_[node * dim];
+    const Real* upper = &upper_[node * dim];
+
+    Real result = 0;
+    for (size_t c = 0; c < dim; ++c)
+    {
+        Real x = points_.coordinate(q.i, c);
+        Real d = std::max(std::max(lower[c] - x, x - upper[c]), Real(0));
+        result += d*d;
+    }
+    return result;
+}
+
+// the lowest level that still counts as an improvement over the given one
+template<class T>
+typename BarycentersMST<T>::Real
+BarycentersMST<T>::
+threshold(Real level) const
+{
+    if (eps_ <= 0 || level <= 0 || level == std::numeric_limits<Real>::infinity())
+        return level;
+
+    // the bottom of the interval ((1 + eps)^(i-1), (1 + eps)^i] that contains the level
+    Real log1p_eps = std::log1p(eps_);
+    return std::exp((std::ceil(std::log(level) / log1p_eps) - 1) * log1p_eps);
+}
+
+template<class T>
+bool
+BarycentersMST<T>::
+prune(const Query& q, Real lower_bound) const
+{
+    // the bound and the levels round differently, so leave some slack; visiting a cell is always safe
+    static constexpr Real slack = 1 + 64*std::numeric_limits<Real>::epsilon();
+
+    Real bound = std::min(q.threshold, bounds_[q.component].load(std::memory_order_relaxed));
+    return lower_bound > bound * slack;
+}
+
+template<class T>
+void
+BarycentersMST<T>::
+label_nodes()
+{
+    // children follow their parents, so the nodes are labeled bottom-up in reverse
+    for (size_t i = nodes_.size(); i-- > 0; )
+    {
+        Node& node = nodes_[i];
+        if (node.right == none)
+        {
+            node.component = components_[order_[node.b]];
+            for (size_t j = node.b + 1; j < node.e && node.component != none; ++j)
+                if (components_[order_[j]] != node.component)
+                    node.component = none;
+        } else if (nodes_[i+1].component == nodes_[node.right].component)
+            node.component = nodes_[node.right].component;
+        else
+            node.component = none;
+    }
+}
+
+template<class T>
+void
+BarycentersMST<T>::
+search(Query& q, size_t node)
+{
+    const Node& n = nodes_[node];
+    if (n.component == q.component)
+        return;
+
+    // since (a + b)^2 <= 2(a^2 + b^2), distance(u,v) >= max(value(u), value(v), sq_dist/4 + (value(u) + value(v))/2)
+    Real lower_bound = std::max(q.value, sq_distance(q, node)/4 + (q.value + n.value)/2);
+    if (prune(q, lower_bound))
+        return;
+
+    if (n.right == none)
+    {
+        Real levels[leaf_size];
+        points_.distances(q.i, n.b, n.e, levels);
+        for (size_t j = n.b; j < n.e; ++j)
+        {
+            size_t v = order_[j];
+            if (components_[v] == q.component)
+                continue;
+
+            Real level = levels[j - n.b];
+            if (level < q.level || (level == q.level && v < q.v))
+            {
+                q.v         = v;
+                q.level     = level;
+                q.threshold = threshold(level);
+
+                // share the bound with the rest of the component
+                std::atomic<Real>& bound = bounds_[q.component];
+                Real current = bound.load(std::memory_order_relaxed);
+                while (q.threshold < current && !bound.compare_exchange_weak(current, q.threshold, std::memory_order_relaxed))
+                    ;
+            }
+        }
+        return;
+    }
+
+    // nearer child first
+    size_t left = node + 1, right = n.right;
+    if (sq_distance(q, right) < sq_distance(q, left))
+        std::swap(left, right);
+    search(q, left);
+    search(q, right);
+}
+
+template<class T>
+size_t
+BarycentersMST<T>::
+find(size_t u)
+{
+    while (parent_[u] != u)
+    {
+        parent_[u] = parent_[parent_[u]];
+        u = parent_[u];
+    }
+    return u;
+}
+
+// The same tree by Prim's algorithm over all the pairs, in O(n) memory: every step adds the barycenter closest
+// to the tree, and updates the levels of the rest against it. No pruning, so it evaluates all n*(n-1)/2 levels
+// in any dimension; the levels of a step are evaluated in parallel, block by block, with distances().
+template<class T>
+typename BarycentersMST<T>::EdgeContainer
+all_pairs_mst(const BarycentersContainer<T>& barycenters, unsigned threads = 0)
+{
+    using Real          = T;
+    using Edge          = typename BarycentersMST<T>::Edge;
+
+    static constexpr size_t block = 4096;
+
+    size_t n = barycenters.size();
+    typename BarycentersMST<T>::EdgeContainer edges;
+    if (n == 0)
+        return edges;
+    edges.reserve(n - 1);
+
+    // the barycenters outside the tree (compacted, so that the blocks are contiguous), their lowest level
+    // to the tree, and the barycenter in the tree that achieves it
+    size_t                  dim = barycenters.dimension();
+    BarycentersContainer<T> rest(n - 1, dim);
+    std::vector<size_t>     ids(n - 1), from(n - 1, 0);
+    std::vector<Real>       level(n - 1, std::numeric_limits<Real>::infinity());
+    for (size_t i = 0; i < n - 1; ++i)
+    {
+        ids[i] = i + 1;
+        for (size_t c = 0; c < dim; ++c)
+            rest.coordinate(i, c) = barycenters.coordinate(i + 1, c);
+        rest.weight(i) = barycenters.weight(i + 1);
+    }
+
+    std::vector<size_t>     best((n + block - 1) / block);
+    std::vector<Real>       levels(n - 1);
+
+    // the barycenter that joined the tree last
+    std::vector<Real>       x(dim);
+    size_t                  xid = 0;
+    Real                    xw  = barycenters.weight(0);
+    for (size_t c = 0; c < dim; ++c)
+        x[c] = barycenters.coordinate(0, c);
+
+    for (size_t m = n - 1; m > 0; --m)
+    {
+        // update against x, and find the lowest level in every block; ties go to the lowest barycenter, so the blocks do not matter
+        size_t blocks = (m + block - 1) / block;
+        nesoi::for_each(blocks, [&](size_t t)
+        {
+            size_t b = t * block, e = std::min(b + block, m);
+            rest.distances(&x[0], xw, b, e, &levels[b]);
+
+            size_t j = b;
+            for (size_t i = b; i < e; ++i)
+            {
+                if (levels[i] < level[i])
+                {
+                    level[i] = levels[i];
+                    from[i]  = xid;
+                }
+                if (level[i] < level[j] || (level[i] == level[j] && ids[i] < ids[j]))
+                    j = i;
+            }
+            best[t] = j;
+        }, threads);
+
+        size_t j = best[0];
+        for (size_t t = 1; t < blocks; ++t)
+        {
+            size_t i = best[t];
+            if (level[i] < level[j] || (level[i] == level[j] && ids[i] < ids[j]))
+                j = i;
+        }
+
+        // move j into the tree, and the last barycenter outside into its place
+        xid = ids[j];
+        xw  = rest.weight(j);
+        for (size_t c = 0; c < dim; ++c)
+            x[c] = rest.coordinate(j, c);
+        edges.push_back(Edge { from[j], xid, level[j] });
+
+        size_t last = m - 1;
+        ids[j]   = ids[last];
+        from[j]  = from[last];
+        level[j] = level[last];
+        for (size_t c = 0; c < dim; ++c)
+            rest.coordinate(j, c) = rest.coordinate(last, c);
+        rest.weight(j) = rest.weight(last);
+    }
+
+    return edges;
+}
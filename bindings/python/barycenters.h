@@ -1,7 +1,17 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <utility>
 
+#include <nesoi/parallel.h>
+#include <nesoi/simd.h>
+
+// Barycenters of the k nearest neighbors, stored as structure-of-arrays: axis c
+// of barycenter i at coordinates[c*n + i], so that the levels from one barycenter
+// to a range of others are computed in vectorized passes (see distances()).
+// The stored weight is the negative of the actual weight.
 template<class T>
 class BarycentersContainer
 {
@@ -11,47 +21,192 @@ class BarycentersContainer
 
     public:
                 BarycentersContainer(size_t n, size_t dim):
-                    n_(n), dim_(dim), coordinates(n * (dim + 1))    {}
+                    n_(n), dim_(dim), coordinates(n * dim), weights(n)  {}
+
+        Real    coordinate(size_t i, size_t c) const                { return coordinates[c * n_ + i]; }
+        Real&   coordinate(size_t i, size_t c)                      { return coordinates[c * n_ + i]; }
 
-        Real    coordinate(size_t i, size_t c) const                { return coordinates[i * (dim_ + 1) + c]; }
-        Real&   coordinate(size_t i, size_t c)                      { return coordinates[i * (dim_ + 1) + c]; }
+        Real    weight(size_t i) const                              { return weights[i]; }
+        Real&   weight(size_t i)                                    { return weights[i]; }
 
-        Real    weight(size_t i) const                              { return coordinate(i, dim_); }
-        Real&   weight(size_t i)                                    { return coordinate(i, dim_); }
+        // barycenter and weight of the neighbors in every row of the CSR result of KDTree::findK(),
+        // row i for barycenter i; the neighbors of a row are gathered into a structure-of-arrays block,
+        // so that the deviations from the mean go through the vectorized sq_distances()
+        template<class Traits, class Neighbors>
+        void    compute(const Traits& traits, const Neighbors& neighbors, unsigned threads = 0);
 
+        // level at which the balls around u and v meet
         Real    distance(size_t u, size_t v) const;
 
+        // levels from the point x, with weight w, to the barycenters b, ..., e-1
+        void    distances(const Real* x, Real w, size_t b, size_t e, Real* out) const;
+        void    distances(size_t u, size_t b, size_t e, Real* out) const;
+
+        // calls f(u, v, distance(u,v)) for every pair u < v; in parallel, over square tiles of the upper triangle,
+        // so that both sides of a tile stay in cache, with the rows of a tile evaluated by distances()
+        template<class F>
+        void    for_each_pair(const F& f, unsigned threads = 0) const;
+
+        static Real
+                level(Real sq_dist, Real wu, Real wv);
+
         size_t  dimension() const                                   { return dim_; }
         size_t  size() const                                        { return n_; }
 
+    private:
+        static constexpr size_t tile = 512;
+
     private:
         size_t              n_;
         size_t              dim_;
         CoordinateContainer coordinates;
+        CoordinateContainer weights;
 };
 
+template<class T>
+template<class Traits, class Neighbors>
+void
+BarycentersContainer<T>::
+compute(const Traits& traits, const Neighbors& neighbors, unsigned threads)
+{
+    // per participant: the neighbors of one barycenter as a structure-of-arrays block, their mean, and their deviations
+    struct Scratch { std::vector<Real> block, mean, sq_dists; };
+    std::vector<Scratch> scratch(nesoi::concurrency(threads));
+
+    nesoi::for_each(size(), [&](size_t u)
+    {
+        size_t  b = neighbors.offsets[u],
+                k = neighbors.offsets[u+1] - b;
+
+        if (k == 0)
+        {
+            for (size_t c = 0; c < dimension(); ++c)
+                coordinate(u, c) = 0;
+            this->weight(u) = 0;
+            return;
+        }
+
+        Scratch& s = scratch[nesoi::participant()];
+        s.block.resize(dimension() * k);
+        s.mean.resize(dimension());
+        s.sq_dists.resize(k);
+
+        // axis by axis, so that the neighbors of every axis are contiguous
+        for (size_t c = 0; c < dimension(); ++c)
+        {
+            Real* x   = &s.block[c*k];
+            Real  sum = 0;
+            for (size_t j = 0; j < k; ++j)
+            {
+                x[j] = traits.coordinate(neighbors.handles[b + j], c);
+                sum += x[j];
+            }
+            s.mean[c] = coordinate(u, c) = sum / k;
+        }
+
+        // the weight is the average square distance to the defining points; the deviations from the mean
+        // (a second pass, as stable as a running mean) through the vectorized kernel
+        nesoi::simd::sq_distances(&s.mean[0], &s.block[0], dimension(), k, &s.sq_dists[0]);
+        Real m2 = 0;
+        for (size_t j = 0; j < k; ++j)
+            m2 += s.sq_dists[j];
+
+        this->weight(u) = -m2 / k;
+    }, threads);
+}
+
+template<class T>
+typename BarycentersContainer<T>::Real
+BarycentersContainer<T>::
+level(Real sq_dist, Real wu, Real wv)
+{
+    // ordered, so that the rounding does not depend on the order of u and v; branch-free, so that the loop
+    // in distances() vectorizes (see -fno-trapping-math for kdistance.cpp in CMakeLists.txt)
+    Real hi = wu < wv ? wv : wu,
+         lo = wu < wv ? wu : wv,
+         d  = hi - lo;
+
+    Real t    = d/sq_dist + 1;
+    Real meet = t*t*(sq_dist/4) - hi;
+
+    // intersection happens whenever lower weight point appears
+    return sq_dist <= d ? -lo : meet;
+}
+
+// through the same kernel as distances(), so that every construction sees the same levels
 template<class T>
 typename BarycentersContainer<T>::Real
 BarycentersContainer<T>::
 distance(size_t u, size_t v) const
 {
-    Real sq_dist = 0;
-    for (size_t i = 0; i < dimension(); ++i)
+    Real result;
+    distances(u, v, v + 1, &result);
+    return result;
+}
+
+template<class T>
+void
+BarycentersContainer<T>::
+distances(const Real* x, Real w, size_t b, size_t e, Real* out) const
+{
+    size_t m = e - b;
+    nesoi::simd::sq_distances(x, &coordinates[0] + b, n_, dimension(), m, out);
+
+    const Real* wv = &weights[b];
+    for (size_t j = 0; j < m; ++j)
+        out[j] = level(out[j], w, wv[j]);
+}
+
+template<class T>
+void
+BarycentersContainer<T>::
+distances(size_t u, size_t b, size_t e, Real* out) const
+{
+    static constexpr size_t max_dim = 64;
+
+    Real              x[max_dim];
+    std::vector<Real> xs;
+    Real*             q = x;
+    if (dimension() > max_dim)
     {
-        Real diff = coordinate(u, i) - coordinate(v, i);
-        sq_dist += diff*diff;
+        xs.resize(dimension());
+        q = &xs[0];
     }
+    for (size_t c = 0; c < dimension(); ++c)
+        q[c] = coordinate(u, c);
 
-    // intersection happens whenever lower weight point appears
-    if (sq_dist <= std::abs(weight(u) - weight(v)))
-        return std::max(-weight(u), -weight(v));
+    distances(q, weight(u), b, e, out);
+}
 
-    Real result;
-    result  = (weight(u) - weight(v))/sq_dist;
-    result += 1.;
-    result *= result;
-    result *= sq_dist / 4;
-    result -= weight(u);
+template<class T>
+template<class F>
+void
+BarycentersContainer<T>::
+for_each_pair(const F& f, unsigned threads) const
+{
+    // tiles (I,J) with I <= J; the ones on the diagonal hold half the pairs, which the work stealing in for_each() evens out
+    size_t m = (size() + tile - 1) / tile;
+    std::vector<std::pair<size_t,size_t>> tiles;
+    tiles.reserve(m * (m + 1) / 2);
+    for (size_t i = 0; i < m; ++i)
+        for (size_t j = i; j < m; ++j)
+            tiles.emplace_back(i,j);
 
-    return result;
+    nesoi::for_each(tiles.size(), [&](size_t t)
+    {
+        size_t ib = tiles[t].first * tile,  ie = std::min(ib + tile, size()),
+               jb = tiles[t].second * tile, je = std::min(jb + tile, size());
+
+        Real levels[tile];
+        for (size_t u = ib; u < ie; ++u)
+        {
+            size_t b = std::max(jb, u + 1);
+            if (b >= je)
+                continue;
+
+            distances(u, b, je, levels);
+            for (size_t v = b; v < je; ++v)
+                f(u, v, levels[v - b]);
+        }
+    }, threads);
 }
@@ -1,5 +1,11 @@
 #include <cmath>
 #include <chrono>
+#include <iostream>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
 
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
@@ -15,130 +21,209 @@ using Vertex = PyTMT::Vertex;
 using Degree = PyTMT::Value;
 
 
+// scipy-style condensed distance matrix: the distances from u to v = u+1, ..., n-1 are contiguous (row u)
 template<class T>
-struct ExplicitDistances
+struct CondensedMatrix
 {
-    using IndexType     = Vertex;
-    using DistanceType  = float;
+    using Array         = py::array_t<T, py::array::c_style | py::array::forcecast>;
 
-           ExplicitDistances(const py::array& a_):
-               a(a_), n(static_cast<size_t>(1 + std::sqrt(1 + 8*a.shape(0))/2))        {}
+    // does not own the array (see NumPyTraits)
+                CondensedMatrix(const Array& a):
+                    data(a.data()), n(static_cast<size_t>(1 + std::sqrt(1 + 8*a.shape(0))/2))
+    {
+        if (n*(n-1)/2 != static_cast<size_t>(a.shape(0)))
+            throw std::runtime_error("Condensed matrix cannot have " + std::to_string(a.shape(0)) + " entries");
+    }
+                CondensedMatrix(Array&&)        = delete;
+
+    // row(u)[v - u - 1] is the distance between u and v > u
+    const T*    row(size_t u) const             { return data + n*u - u*(u+1)/2; }
+    size_t      size() const                    { return n; }
+
+    // calls f(u,v) for every pair u < v within eps, walking the rows in parallel
+    template<class F>
+    void        for_each_edge(double eps, const F& f, unsigned threads) const
+    {
+        nesoi::for_each(n, [this,eps,&f](size_t u)
+        {
+            const T* r = row(u);
+            for (size_t v = u + 1; v < n; ++v)
+                if (r[v - u - 1] <= eps)
+                    f(u, v);
+        }, threads);
+    }
 
-    DistanceType operator()(size_t u, size_t v) const
+    const T*            data;
+    size_t              n;
+};
+
+// each_edge for TripletMergeTree::merge_edges(): every edge exactly once, from a pass over the condensed matrix
+template<class T>
+struct CondensedEdges
+{
+    template<class F>
+    void            operator()(const F& f) const
     {
-        if (u == v)
-            return 0;
+        matrix.for_each_edge(eps, f, threads);
+    }
 
-        if (u < v)              // below u must be larger than v
-            std::swap(u,v);
+    const CondensedMatrix<T>&   matrix;
+    double                      eps;
+    unsigned                    threads;
+};
 
-        size_t idx = n*v - v*(v+1)/2 + u - 1 - v;
-        const void* xptr = a.data(idx);
-        T x = *static_cast<const T*>(xptr);
+// each_edge for TripletMergeTree::merge_edges(): the edges gathered by one pass, in per-participant buffers
+struct BufferedEdges
+{
+    using Edges         = std::vector<std::pair<Vertex, Vertex>>;
 
-        return x;
+                    BufferedEdges(const std::vector<Edges>& buffers, unsigned threads):
+                        buffers(buffers), offsets(buffers.size() + 1, 0), threads(threads)
+    {
+        for (size_t i = 0; i < buffers.size(); ++i)
+            offsets[i+1] = offsets[i] + buffers[i].size();
     }
 
-    IndexType   begin() const       { return 0; };
-    IndexType   end() const         { return n; }
-    IndexType   size() const        { return end() - begin(); }
+    // over all the edges at once, so that the work is balanced no matter how the pass split them
+    template<class F>
+    void            operator()(const F& f) const
+    {
+        nesoi::for_each(offsets.back(), [this,&f](size_t j)
+        {
+            size_t i = std::upper_bound(offsets.begin(), offsets.end(), j) - offsets.begin() - 1;
+            const std::pair<Vertex, Vertex>& e = buffers[i][j - offsets[i]];
+            f(e.first, e.second);
+        }, threads);
+    }
 
-    const py::array&    a;
-    size_t              n;
+    const std::vector<Edges>&   buffers;
+    std::vector<size_t>         offsets;
+    unsigned                    threads;
 };
 
-template<class T>
-PyTMT build_degree_tree_euclidean(py::array a, double eps)
+template<class T, unsigned Dim>
+PyTMT build_degree_tree_euclidean(py::array a, double eps, unsigned threads, bool shortcut, bool presort)
 {
+    using Traits        = NumPyTraits<T, Dim>;
+    using KDTree        = nesoi::KDTree<Traits>;
+    using PointHandle   = typename Traits::PointHandle;
+
     size_t n = a.shape()[0];
 
+    typename Traits::Array array(a);            // outlives the traits
+    Traits traits(array);
+
+    py::gil_scoped_release release;             // nothing below touches Python objects
+
     PyTMT tmt(n, true);
+    tmt.set_threads(threads);
+    tmt.set_shortcut(shortcut);
+    tmt.set_presort(presort);
 
     using clock = std::chrono::steady_clock;
     using sec = std::chrono::duration<double>;
 
     auto start = clock::now();
 
-    // build k-d tree
-    using Traits        = NumPyTraits<T>;
-    using KDTree        = nesoi::KDTree<Traits>;
-    using PointHandle   = typename Traits::PointHandle;
-
     // fill point handles
     std::vector<PointHandle> handles; handles.reserve(n);
     for (size_t i = 0; i < n; ++i)
         handles.emplace_back(PointHandle {i});
 
-    Traits traits(a);
-    KDTree kdtree(traits, std::move(handles));
+    // build k-d tree
+    KDTree kdtree(traits, std::move(handles), Traits::bucket_size, threads);
 
     std::cerr << "Time to construct k-d tree: " << sec(clock::now() - start).count() << " seconds" << std::endl;
     start = clock::now();
 
-    // find neighbors
-    tmt.for_each_vertex([&](Vertex u)
-                        {
-                            auto neighbors = kdtree.findR(PointHandle {u}, eps);
-
-                            tmt.add(u, neighbors.size() - 1);       // -1 for u itself
+    // one join: merge() needs the values of both endpoints, so the edges are kept until all the degrees are known;
+    // each edge is seen once, so count both ends
+    std::vector<std::atomic<Degree>> degrees(n);
+    std::vector<BufferedEdges::Edges> edges(nesoi::concurrency(threads));
+    kdtree.self_join(eps, [&](PointHandle p, PointHandle q)
+                          {
+                              Vertex u = traits.id(p), v = traits.id(q);
+                              degrees[u].fetch_add(1, std::memory_order_relaxed);
+                              degrees[v].fetch_add(1, std::memory_order_relaxed);
+                              edges[nesoi::participant()].emplace_back(u, v);
+                          });
+    tmt.for_each_vertex([&](Vertex u) { tmt.add(u, degrees[u].load(std::memory_order_relaxed)); });
+
+    std::cerr << "Time to compute degrees: " << sec(clock::now() - start).count() << " seconds" << std::endl;
+    start = clock::now();
 
-                            for (auto hd : neighbors)
-                            {
-                                Vertex v = traits.id(hd.p);
-                                if (u != v && tmt.contains(v))
-                                    tmt.merge(u,v);
-                            }
-                        });
-    tmt.repair();
+    tmt.merge_edges(BufferedEdges(edges, threads));
 
     std::cerr << "Time to build TMT: " << sec(clock::now() - start).count() << " seconds" << std::endl;
+#if defined(NESOI_TMT_STATS)
+    auto stats = tmt.stats();
+    std::cerr << "Average chain length: " << double(stats.steps) / std::max<int64_t>(stats.walks, 1)
+              << " (" << stats.walks << " walks, " << stats.shortcuts << " shortcuts)" << std::endl;
+#endif
 
     return tmt;
 }
 
+// instantiate the pipeline with a compile-time dimension for the common cases
 template<class T>
-PyTMT build_degree_tree_explicit(py::array a, double eps)
+PyTMT build_degree_tree_euclidean(py::array a, double eps, unsigned threads, bool shortcut, bool presort)
 {
-    using Distances = ExplicitDistances<T>;
-
-    Distances distances(a);
-    PyTMT     tmt(distances.size(), true);
-
-    tmt.for_each_vertex([&](Vertex u)
-                        {
-                            Degree degree = 0;
-                            auto   sz     = tmt.size();
-                            for (Vertex v = 0; v < sz; ++v)
-                                if (distances(u,v) <= eps)
-                                    ++degree;
-                            degree -= 1;        // for u itself
-                            tmt.add(u, degree);
-
-                            for (Vertex v = 0; v < sz; ++v)
-                                if (u != v && distances(u,v) <= eps && tmt.contains(v))
-                                    tmt.merge(u,v);
-                        });
-    tmt.repair();
+    switch (a.shape()[1])
+    {
+        case 2:     return build_degree_tree_euclidean<T,2>(a,eps,threads,shortcut,presort);
+        case 3:     return build_degree_tree_euclidean<T,3>(a,eps,threads,shortcut,presort);
+        case 8:     return build_degree_tree_euclidean<T,8>(a,eps,threads,shortcut,presort);
+        default:    return build_degree_tree_euclidean<T,0>(a,eps,threads,shortcut,presort);
+    }
+}
+
+template<class T>
+PyTMT build_degree_tree_explicit(py::array a, double eps, unsigned threads, bool shortcut, bool presort)
+{
+    using Matrix = CondensedMatrix<T>;
+
+    typename Matrix::Array array(a);            // outlives the matrix
+    Matrix matrix(array);
+
+    py::gil_scoped_release release;
+
+    size_t n = matrix.size();
+
+    PyTMT     tmt(n, true);
+    tmt.set_threads(threads);
+    tmt.set_shortcut(shortcut);
+    tmt.set_presort(presort);
+
+    // degrees first, since merge() needs the values of both endpoints; each pair is read once, so count both ends
+    std::vector<std::atomic<Degree>> degrees(n);
+    matrix.for_each_edge(eps, [&degrees](size_t u, size_t v)
+                              {
+                                  degrees[u].fetch_add(1, std::memory_order_relaxed);
+                                  degrees[v].fetch_add(1, std::memory_order_relaxed);
+                              }, threads);
+    tmt.for_each_vertex([&](Vertex u) { tmt.add(u, degrees[u].load(std::memory_order_relaxed)); });
+
+    tmt.merge_edges(CondensedEdges<T> { matrix, eps, threads });
 
     return tmt;
 }
 
-PyTMT build_degree_tree(py::array a, double eps)
+PyTMT build_degree_tree(py::array a, double eps, unsigned threads, bool shortcut, bool presort)
 {
     if (a.ndim() == 2)
     {
         if (a.dtype().is(py::dtype::of<float>()))
-            return build_degree_tree_euclidean<float>(a,eps);
+            return build_degree_tree_euclidean<float>(a,eps,threads,shortcut,presort);
         else if (a.dtype().is(py::dtype::of<double>()))
-            return build_degree_tree_euclidean<double>(a,eps);
+            return build_degree_tree_euclidean<double>(a,eps,threads,shortcut,presort);
         else
             throw std::runtime_error("Unknown array dtype");
     } else if (a.ndim() == 1)
     {
         if (a.dtype().is(py::dtype::of<float>()))
-            return build_degree_tree_explicit<float>(a,eps);
+            return build_degree_tree_explicit<float>(a,eps,threads,shortcut,presort);
         else if (a.dtype().is(py::dtype::of<double>()))
-            return build_degree_tree_explicit<double>(a,eps);
+            return build_degree_tree_explicit<double>(a,eps,threads,shortcut,presort);
         else
             throw std::runtime_error("Unknown array dtype");
     } else
@@ -151,6 +236,8 @@ void init_degree_tree(py::module& m)
     using namespace pybind11::literals;
 
     m.def("build_degree_tree",  &build_degree_tree,
-          "data"_a, "eps"_a,
-          "returns the merge tree of the graph with respect to the degree function");
+          "data"_a, "eps"_a, "threads"_a = 0, "shortcut"_a = false, "presort"_a = false,
+          "returns the merge tree of the graph with respect to the degree function; "
+          "data is either a point cloud or a condensed distance matrix (as in scipy); "
+          "shortcut and presort select the modes of the construction (see TMT)");
 }
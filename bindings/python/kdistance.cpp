@@ -7,87 +7,135 @@ namespace py = pybind11;
 
 #include "numpy-traits.h"
 #include "barycenters.h"
+#include "barycenters-mst.h"
 
 //using PyTMT  = nesoi::TripletMergeTree<float, std::uint64_t>;
 using PyTMT  = nesoi::TripletMergeTree<float, std::uint32_t>;
 using Vertex = PyTMT::Vertex;
 using Degree = PyTMT::Value;
 
+// dense: a vertex for every pair of barycenters; sparse: only the edges of their minimum spanning tree, found with a k-d tree;
+// stream: the same tree from all the pairs, in linear memory
+enum class KDistanceMethod { dense, sparse, stream };
+
+// each_edge for TripletMergeTree::merge_edges(): every edge of the spanning tree is the vertex n + i, between its endpoints
+template<class Edges>
+struct SpanningTreeEdges
+{
+    template<class F>
+    void            operator()(const F& f) const
+    {
+        nesoi::for_each(edges.size(), [this,&f](size_t i)
+        {
+            f(edges[i].u, n + i);
+            f(edges[i].v, n + i);
+        }, threads);
+    }
+
+    const Edges&    edges;
+    size_t          n;
+    unsigned        threads;
+};
+
 template<class T>
-PyTMT build_kdistance_tree_euclidean(py::array a, size_t k)
+PyTMT build_kdistance_tree_dense(const BarycentersContainer<T>& barycenters, unsigned threads)
 {
-    size_t n = a.shape()[0];
+    size_t n = barycenters.size();
 
     PyTMT tmt(n + n * (n - 1) / 2, false);       // barycenters + all pairwise edges
+    tmt.set_threads(threads);
 
-    // build k-d tree
-    using Traits        = NumPyTraits<T>;
+    tmt.for_each_vertex(n, [&](Vertex u) { tmt.add(u, -barycenters.weight(u)); });
+
+    // build the actual tree: for every pair, add the edge as a vertex
+    barycenters.for_each_pair([&](size_t u, size_t v, T dist)
+    {
+        Vertex uv = n + n*u - u*(u+1)/2 + v - 1 - u;    // vertex uv encodes the edge (u,v)
+        tmt.add(uv, dist);
+        tmt.merge(u, uv);
+        tmt.merge(v, uv);
+    }, threads);
+
+    tmt.repair();
+
+    return tmt;
+}
+
+template<class T>
+PyTMT build_kdistance_tree_spanning(const BarycentersContainer<T>& barycenters, const typename BarycentersMST<T>::EdgeContainer& edges, unsigned threads)
+{
+    size_t n = barycenters.size();
+
+    PyTMT tmt(n + edges.size(), false);          // barycenters + the edges of the spanning tree
+    tmt.set_threads(threads);
+
+    tmt.for_each_vertex(n, [&](Vertex u) { tmt.add(u, -barycenters.weight(u)); });
+    tmt.for_each_vertex(edges.size(), [&](Vertex i) { tmt.add(n + i, edges[i].level); });
+
+    tmt.merge_edges(SpanningTreeEdges<typename BarycentersMST<T>::EdgeContainer> { edges, n, threads });
+
+    return tmt;
+}
+
+template<class T, unsigned Dim>
+PyTMT build_kdistance_tree_euclidean(py::array a, size_t k, nesoi::QueryOrder order, unsigned threads, KDistanceMethod method, double eps)
+{
+    using Traits        = NumPyTraits<T, Dim>;
     using KDTree        = nesoi::KDTree<Traits>;
     using PointHandle   = typename Traits::PointHandle;
-    using DistanceType  = typename Traits::DistanceType;
+
+    size_t n = a.shape()[0];
+
+    typename Traits::Array array(a);            // outlives the traits
+    Traits traits(array);
+
+    py::gil_scoped_release release;             // nothing below touches Python objects
 
     // fill point handles
     std::vector<PointHandle> handles; handles.reserve(n);
     for (size_t i = 0; i < n; ++i)
         handles.emplace_back(PointHandle {i});
 
-    Traits traits(a);
-    KDTree kdtree(traits, std::move(handles));
+    // build k-d tree
+    KDTree kdtree(traits, handles, Traits::bucket_size, threads);
+
+    // find neighbors, all at once
+    auto neighbors = kdtree.findK(handles, k, order);
 
     // find witnessed barycenters
     BarycentersContainer<T> barycenters(n, traits.dimension());
+    barycenters.compute(traits, neighbors, threads);
 
-    // find neighbors
-    tmt.for_each_vertex(n, [&](Vertex u)
+    switch (method)
     {
-        auto neighbors = kdtree.findK(PointHandle {u}, k);
-        auto nbr_sz    = neighbors.size();
-
-        // compute barycenter
-        for (auto hd : neighbors)
-            for (size_t i = 0; i < traits.dimension(); ++i)
-                barycenters.coordinate(u, i) += traits.coordinate(hd.p, i) / nbr_sz;
-
-        // compute the weight (average square distance to the defining points)
-        DistanceType weight = 0;
-        for (auto hd : neighbors)
-        {
-            for (size_t i = 0; i < traits.dimension(); ++i)
-            {
-                DistanceType diff = barycenters.coordinate(u,i) - traits.coordinate(hd.p, i);
-                weight += diff*diff / nbr_sz;
-            }
-        }
-        barycenters.weight(u) = -weight;
-        tmt.add(u, weight);     // NB: negative of the actual weight
-    });
+        case KDistanceMethod::dense:    return build_kdistance_tree_dense(barycenters, threads);
+        case KDistanceMethod::sparse:   return build_kdistance_tree_spanning(barycenters, BarycentersMST<T>(barycenters, eps, threads).edges(), threads);
+        case KDistanceMethod::stream:   return build_kdistance_tree_spanning(barycenters, all_pairs_mst(barycenters, threads), threads);
+    }
+    throw std::runtime_error("Unknown method");
+}
 
-    // build the actual tree: for every pair, add the edge as a vertex
-    tmt.for_each_vertex(n, [&](Vertex u)
+// instantiate the pipeline with a compile-time dimension for the common cases
+template<class T>
+PyTMT build_kdistance_tree_euclidean(py::array a, size_t k, nesoi::QueryOrder order, unsigned threads, KDistanceMethod method, double eps)
+{
+    switch (a.shape()[1])
     {
-        for (Vertex v = u + 1; v < barycenters.size(); ++v)
-        {
-            auto dist = barycenters.distance(u,v);
-            Vertex uv = n + n*u - u*(u+1)/2 + v - 1 - u;    // vertex uv encodes the edge (u,v)
-            tmt.add(uv, dist);
-            tmt.merge(u, uv);
-            tmt.merge(v, uv);
-        }
-    });
-
-    tmt.repair();
-
-    return tmt;
+        case 2:     return build_kdistance_tree_euclidean<T,2>(a,k,order,threads,method,eps);
+        case 3:     return build_kdistance_tree_euclidean<T,3>(a,k,order,threads,method,eps);
+        case 8:     return build_kdistance_tree_euclidean<T,8>(a,k,order,threads,method,eps);
+        default:    return build_kdistance_tree_euclidean<T,0>(a,k,order,threads,method,eps);
+    }
 }
 
-PyTMT build_kdistance_tree(py::array a, size_t k)
+PyTMT build_kdistance_tree(py::array a, size_t k, nesoi::QueryOrder order, unsigned threads, KDistanceMethod method, double eps)
 {
     if (a.ndim() == 2)
     {
         if (a.dtype().is(py::dtype::of<float>()))
-            return build_kdistance_tree_euclidean<float>(a,k);
+            return build_kdistance_tree_euclidean<float>(a,k,order,threads,method,eps);
         else if (a.dtype().is(py::dtype::of<double>()))
-            return build_kdistance_tree_euclidean<double>(a,k);
+            return build_kdistance_tree_euclidean<double>(a,k,order,threads,method,eps);
         else
             throw std::runtime_error("Unknown array dtype");
     } else
@@ -98,7 +146,15 @@ void init_kdistance_tree(py::module& m)
 {
     using namespace pybind11::literals;
 
+    py::enum_<KDistanceMethod>(m, "KDistanceMethod", "construction of the k-distance merge tree")
+        .value("dense",     KDistanceMethod::dense,     "a vertex for every pair of barycenters, quadratic memory")
+        .value("sparse",    KDistanceMethod::sparse,    "only the edges of the minimum spanning tree of the barycenters, found with a k-d tree")
+        .value("stream",    KDistanceMethod::stream,    "the same tree from all the pairs, in linear memory; does not depend on the dimension")
+    ;
+
     m.def("build_kdistance_tree",  &build_kdistance_tree,
-          "data"_a, "k"_a,
-          "returns the merge tree of the graph with respect to the kdistance function");
+          "data"_a, "k"_a, "order"_a = nesoi::QueryOrder::kdtree, "threads"_a = 0, "method"_a = KDistanceMethod::dense, "eps"_a = 0.,
+          "returns the merge tree of the graph with respect to the kdistance function; "
+          "sparse and stream keep only the edges of the minimum spanning tree of the barycenters (vertex n + i is the i-th edge), "
+          "which gives the same diagram; with eps > 0, sparse prunes more, and the deaths are at most (1 + eps) times too high");
 }
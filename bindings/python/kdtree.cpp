@@ -0,0 +1,118 @@
+#include <cstdint>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+namespace py = pybind11;
+
+#include <nesoi/kd-tree.h>
+
+#include "numpy-traits.h"
+
+using Index = std::int64_t;
+
+// neighbors of every point, as NumPy arrays (offsets, indices, distances) in CSR form;
+// the rows follow the order of the points
+template<class T, unsigned Dim, class Find>
+py::tuple neighbor_graph(py::array a, const Find& find, unsigned threads)
+{
+    using Traits        = NumPyTraits<T, Dim>;
+    using KDTree        = nesoi::KDTree<Traits>;
+    using PointHandle   = typename Traits::PointHandle;
+
+    size_t n = a.shape()[0];
+
+    typename Traits::Array array(a);            // outlives the traits
+    Traits traits(array);
+
+    std::vector<PointHandle> handles; handles.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+        handles.emplace_back(PointHandle {i});
+
+    typename KDTree::Neighbors neighbors;
+    {
+        py::gil_scoped_release release;
+
+        KDTree kdtree(traits, handles, Traits::bucket_size, threads);
+        neighbors = find(kdtree, handles);      // rows follow handles, i.e., the points
+    }
+
+    size_t m = neighbors.handles.size();
+    py::array_t<Index>  offsets(std::vector<size_t> { n + 1 }),
+                        indices(std::vector<size_t> { m });
+    py::array_t<T>      distances(std::vector<size_t> { m });
+
+    Index*  o = offsets.mutable_data();
+    Index*  i = indices.mutable_data();
+    T*      d = distances.mutable_data();
+    for (size_t j = 0; j <= n; ++j)
+        o[j] = neighbors.offsets[j];
+    for (size_t j = 0; j < m; ++j)
+    {
+        i[j] = traits.id(neighbors.handles[j]);
+        d[j] = neighbors.distances[j];
+    }
+
+    return py::make_tuple(offsets, indices, distances);
+}
+
+template<class T, class Find>
+py::tuple neighbor_graph(py::array a, const Find& find, unsigned threads)
+{
+    switch (a.shape()[1])
+    {
+        case 2:     return neighbor_graph<T,2>(a,find,threads);
+        case 3:     return neighbor_graph<T,3>(a,find,threads);
+        case 8:     return neighbor_graph<T,8>(a,find,threads);
+        default:    return neighbor_graph<T,0>(a,find,threads);
+    }
+}
+
+template<class Find>
+py::tuple neighbor_graph(py::array a, const Find& find, unsigned threads)
+{
+    if (a.ndim() != 2)
+        throw std::runtime_error("Unknown input dimension: can only process 2D arrays");
+
+    if (a.dtype().is(py::dtype::of<float>()))
+        return neighbor_graph<float>(a,find,threads);
+    else if (a.dtype().is(py::dtype::of<double>()))
+        return neighbor_graph<double>(a,find,threads);
+    else
+        throw std::runtime_error("Unknown array dtype");
+}
+
+struct FindK
+{
+    template<class KDTree>
+    typename KDTree::Neighbors  operator()(const KDTree& kdtree, const typename KDTree::HandleContainer& handles) const   { return kdtree.findK(handles, k, order); }
+    size_t              k;
+    nesoi::QueryOrder   order;
+};
+
+struct FindR
+{
+    template<class KDTree>
+    typename KDTree::Neighbors  operator()(const KDTree& kdtree, const typename KDTree::HandleContainer& handles) const   { return kdtree.findR(handles, r, order); }
+    double              r;
+    nesoi::QueryOrder   order;
+};
+
+py::tuple knn_graph(py::array a, size_t k, nesoi::QueryOrder order, unsigned threads)        { return neighbor_graph(a, FindK { k, order }, threads); }
+py::tuple radius_graph(py::array a, double r, nesoi::QueryOrder order, unsigned threads)     { return neighbor_graph(a, FindR { r, order }, threads); }
+
+void init_kdtree(py::module& m)
+{
+    using namespace pybind11::literals;
+
+    py::enum_<nesoi::QueryOrder>(m, "QueryOrder", "order in which the points are queried: as given, by k-d tree leaf, or along the Morton curve")
+        .value("input",     nesoi::QueryOrder::input)
+        .value("kdtree",    nesoi::QueryOrder::kdtree)
+        .value("morton",    nesoi::QueryOrder::morton);
+
+    m.def("knn_graph",      &knn_graph,
+          "data"_a, "k"_a, "order"_a = nesoi::QueryOrder::kdtree, "threads"_a = 0,
+          "returns (offsets, indices, distances): the k nearest neighbors of point i (itself included), sorted by distance, are indices[offsets[i]:offsets[i+1]]");
+    m.def("radius_graph",   &radius_graph,
+          "data"_a, "r"_a, "order"_a = nesoi::QueryOrder::kdtree, "threads"_a = 0,
+          "returns (offsets, indices, distances): the neighbors within r of point i (itself included), sorted by distance, are indices[offsets[i]:offsets[i+1]]");
+}
@@ -1,15 +1,37 @@
 #include <pybind11/pybind11.h>
 namespace py = pybind11;
 
+#include <nesoi/parallel.h>
+
 #include "tmt.h"
 
 void init_degree_tree(py::module&);
 void init_kdistance_tree(py::module&);
+void init_kdtree(py::module&);
 
 PYBIND11_MODULE(_nesoi, m)
 {
     m.doc() = "Nesoi python bindings";
 
+    using namespace pybind11::literals;
+    m.def("set_execution",  [](unsigned threads, std::vector<int> cpus, int numa_node)
+                            {
+                                nesoi::Execution e;
+                                e.threads   = threads;
+                                e.cpus      = cpus;
+                                e.numa_node = numa_node;
+                                nesoi::set_execution(e);
+                            },
+          "threads"_a = 0, "cpus"_a = std::vector<int>(), "numa_node"_a = -1,
+          "set the default number of threads (0 = one per available CPU), the CPUs to pin the threads of a parallel section to, "
+          "and the NUMA node whose CPUs to run on (memory is not bound to it); "
+          "the worker threads serve one parallel section at a time, so while they are busy, a call from another Python thread runs on that thread alone");
+    m.def("concurrency",    []() { return nesoi::concurrency(); },
+          "default number of threads");
+
+    init_kdtree(m);         // first: registers QueryOrder and GridConnectivity, used by the defaults below
+    init_grid(m);
+
     init_tmt<std::uint32_t, std::uint32_t>(m, "_uint32");
     init_degree_tree(m);
 
@@ -3,11 +3,16 @@
 #include <pybind11/numpy.h>
 namespace py = pybind11;
 
-template<class Real_>
+#include <nesoi/simd.h>
+
+#include <stdexcept>
+
+// Dim > 0 fixes the dimension at compile time (see build_*_tree for the dispatch); Dim == 0 reads it from the array
+template<class Real_, unsigned Dim = 0>
 struct NumPyTraits
 {
     using Real  = Real_;
-    using Array = py::array_t<Real>;
+    using Array = py::array_t<Real, py::array::c_style | py::array::forcecast>;
 
     struct PointHandle
     {
@@ -22,29 +27,46 @@ struct NumPyTraits
     using Coordinate    = Real;
     using DistanceType  = Real;
 
+    static constexpr size_t   bucket_size       = 32;     // leaf size of the k-d trees built over these traits
+    static constexpr unsigned static_dimension  = Dim;
+
+    // does not own the array, so that the traits can be copied with the GIL released;
+    // the caller keeps the array alive (a temporary, e.g., a converted py::array, would dangle)
                     NumPyTraits(const Array& a):
-                        a_(a)                                           { dim_ = a_.shape()[1]; }
+                        data_(a.data())
+    {
+        dim_ = a.shape()[1];
+        if (Dim && dim_ != Dim)
+            throw std::runtime_error("Array dimension does not match the traits");
+    }
+                    NumPyTraits(Array&&)                                = delete;
 
     DistanceType    distance(PointHandle p1, PointHandle p2) const      { return sqrt(sq_distance(p1, p2)); }
     DistanceType    sq_distance(PointHandle p1, PointHandle p2) const
     {
+        if (Dim == 0)
+            return nesoi::simd::sq_distance(point(p1), point(p2), dim_);
+
+        // fixed dimension: fully unrolled by the compiler
+        const Real* x = point(p1);
+        const Real* y = point(p2);
         Real sq_dist = 0;
-        for (unsigned i = 0; i < dim_; ++i)
+        for (unsigned i = 0; i < Dim; ++i)
         {
-            Real x = coordinate(p1, i);
-            Real y = coordinate(p2, i);
-            sq_dist += (x-y)*(x-y);
+            Real d = x[i] - y[i];
+            sq_dist += d*d;
         }
         return sq_dist;
     }
-    unsigned        dimension() const                                   { return dim_; }
-    Real            coordinate(PointHandle h, unsigned i) const         { return *a_.data(h.i, i); }
+    unsigned        dimension() const                                   { return Dim ? Dim : dim_; }
+    Real            coordinate(PointHandle h, unsigned i) const         { return point(h)[i]; }
+    const Real*     point(PointHandle h) const                          { return data_ + h.i * dimension(); }
 
     size_t          id(PointHandle h) const                             { return h.i; }
 
     PointHandle     handle(size_t i) const                              { return PointHandle { i }; }
     PointHandle     handle(PointType p) const                           { return PointHandle { p.i }; }
 
-    Array           a_;
+    const Real*     data_;          // C-contiguous, so that rows can be read directly
     unsigned        dim_;
 };
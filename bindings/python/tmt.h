@@ -15,43 +15,12 @@ clusters(const PyTMT& tmt, typename PyTMT::Value k)
 {
     using Vertex = typename PyTMT::Vertex;
 
-    std::vector<Vertex> s;
-    std::unordered_map<Vertex, Vertex> rep;
-    for (Vertex u = 0; u < tmt.size(); ++u)
-    {
-        Vertex x = u;
-        if (tmt.value(x) < k)
-            continue;
-
-        while (rep.find(x) == rep.end())
-        {
-            s.push_back(x);
-            Vertex s = tmt[x].through;
-            Vertex v = tmt[x].to;
-
-            if (x == v || tmt.value(s) < k)
-                break;
-            else
-                x = v;
-        }
-
-        if (s.empty())
-            continue;
-
-        Vertex v = x;
-        auto it = rep.find(x);
-        if (it != rep.end())
-            v = it->second;
-
-        for (Vertex x : s)
-            rep[x] = v;
-
-        s.clear();
-    }
+    std::vector<int64_t> labels = tmt.cluster_labels(k);
 
     std::map<Vertex, std::vector<Vertex>> clusters;
-    for (auto& x : rep)
-        clusters[x.second].push_back(x.first);
+    for (Vertex u = 0; u < tmt.size(); ++u)
+        if (labels[u] >= 0)
+            clusters[labels[u]].push_back(u);
 
     return clusters;
 }
@@ -77,6 +46,165 @@ T* get_ptr_to_pyarray(py::array_t<T> x, size_t expected_size, bool return_null_f
 }
 
 
+// NumPy array of the given shape that takes over the buffer of v, without copying;
+// the elements of v are laid out as consecutive Ts (e.g., std::pair<T,T> for an N x 2 array)
+template<class T, class Element>
+py::array_t<T> adopt(std::vector<Element>&& v, std::vector<size_t> shape)
+{
+    static_assert(sizeof(Element) % sizeof(T) == 0, "Element must consist of Ts");
+
+    if (v.empty())
+        return py::array_t<T>(shape);
+
+    auto* owned = new std::vector<Element>(std::move(v));
+    py::capsule owner(owned, [](void* x) { delete static_cast<std::vector<Element>*>(x); });
+    return py::array_t<T>(shape, reinterpret_cast<const T*>(owned->data()), owner);
+}
+
+template<class T>
+py::array_t<T> to_numpy(std::vector<T>&& v)                     { size_t n = v.size(); return adopt<T>(std::move(v), { n }); }
+
+template<class T>
+py::array_t<T> to_numpy(std::vector<std::pair<T,T>>&& v)        { size_t n = v.size(); return adopt<T>(std::move(v), { n, 2 }); }
+
+template<class IndexDiagram, class IndexArray>
+py::tuple to_numpy(std::tuple<IndexDiagram, IndexDiagram, IndexArray, IndexArray>&& pairings)
+{
+    return py::make_tuple(to_numpy(std::move(std::get<0>(pairings))),
+                          to_numpy(std::move(std::get<1>(pairings))),
+                          to_numpy(std::move(std::get<2>(pairings))),
+                          to_numpy(std::move(std::get<3>(pairings))));
+}
+
+// calls f() with the GIL released; the result is returned once the GIL is reacquired
+template<class F>
+auto without_gil(const F& f) -> decltype(f())
+{
+    py::gil_scoped_release release;
+    return f();
+}
+
+// edges as a list of pairs, converted by pybind11
+struct EdgeVectorArg
+{
+    template<class EdgeVector>
+    const EdgeVector&           operator()(const EdgeVector& edges, size_t) const   { return edges; }
+};
+
+// edges as an (E,2) integer array, read in place; every id must be a vertex of the tree of size n
+template<class Index>
+struct EdgeArrayArg
+{
+    using Array = py::array_t<Index, py::array::c_style | py::array::forcecast>;
+
+    nesoi::EdgeArray<Index>     operator()(const Array& edges, size_t n) const
+    {
+        if (edges.ndim() != 2 || edges.shape(1) != 2)
+            throw std::runtime_error("Expected an (E,2) array of edges.");
+
+        // negative ids wrap around to values >= n
+        const Index* ids = edges.data();
+        for (py::ssize_t i = 0; i < edges.size(); ++i)
+            if (static_cast<std::uint64_t>(ids[i]) >= n)
+                throw py::value_error("Edge endpoint " + std::to_string(ids[i]) + " is not a vertex (expected 0 <= id < " + std::to_string(n) + ").");
+
+        return nesoi::EdgeArray<Index>(ids, edges.shape(0));
+    }
+};
+
+// connectivity given either as GridConnectivity or as the number of neighbors
+inline nesoi::GridConnectivity to_connectivity(size_t dimension, py::object connectivity)
+{
+    if (py::isinstance<py::int_>(connectivity))
+        return nesoi::grid_connectivity(dimension, connectivity.cast<size_t>());
+    return connectivity.cast<nesoi::GridConnectivity>();
+}
+
+inline void init_grid(py::module& m)
+{
+    using namespace pybind11::literals;
+
+    py::enum_<nesoi::GridConnectivity>(m, "GridConnectivity", "neighbors of a grid vertex")
+        .value("face",          nesoi::GridConnectivity::face,          "along the axes (4 in 2-D, 6 in 3-D)")
+        .value("edge",          nesoi::GridConnectivity::edge,          "also diagonally within 2-D faces (8 in 2-D, 18 in 3-D)")
+        .value("full",          nesoi::GridConnectivity::full,          "all adjacent vertices (8 in 2-D, 26 in 3-D)")
+        .value("freudenthal",   nesoi::GridConnectivity::freudenthal,   "Freudenthal triangulation (6 in 2-D, 14 in 3-D)")
+    ;
+
+    py::class_<nesoi::Grid>(m, "Grid", "implicit graph on the vertices of a grid in row-major (C) order; pass it in place of edges")
+        .def(py::init([](std::vector<size_t> shape, py::object connectivity)
+                      {
+                          return nesoi::Grid(shape, to_connectivity(shape.size(), connectivity));
+                      }),
+             "shape"_a, "connectivity"_a = nesoi::GridConnectivity::face)
+        .def("__len__",         &nesoi::Grid::size,                     "number of vertices")
+        .def_property_readonly("shape",         &nesoi::Grid::shape)
+        .def_property_readonly("connectivity",  &nesoi::Grid::connectivity)
+    ;
+}
+
+// analysis methods, for the edges passed as EdgesArg and handed to the tree as to_edges(edges, n), n the size of the tree;
+// the inputs are converted (and kept alive by the arguments) first, then the GIL is released for the computation
+template<class PyTMT, class EdgesArg, class ToEdges>
+void def_analysis(py::class_<PyTMT>& cls, ToEdges to_edges)
+{
+    using Value = typename PyTMT::Value;
+
+    cls
+        .def("compute_mt",      [to_edges](PyTMT& tmt, const EdgesArg& edges,  py::array_t<int64_t> labels,  py::array_t<Value> values, bool negate)
+                                {
+                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
+                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
+
+                                    auto&& e = to_edges(edges, tmt.size());
+                                    py::gil_scoped_release release;
+
+                                    tmt.compute_mt(e, label_ptr, val_ptr, negate);
+                                }, "compute merge tree")
+
+        .def("n_components",    [to_edges](PyTMT& tmt, const EdgesArg& edges,  py::array_t<int64_t> labels)
+                                {
+                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
+
+                                    auto&& e = to_edges(edges, tmt.size());
+                                    py::gil_scoped_release release;
+
+                                    return tmt.n_components(e, label_ptr);
+                                }, "compute number of connected components of domain")
+
+        .def("diagram",         [to_edges](PyTMT& tmt, const EdgesArg& edges,  py::array_t<int64_t> labels,  py::array_t<Value> values, bool negate, bool squash_root)
+                                {
+                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
+                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
+
+                                    auto&& e = to_edges(edges, tmt.size());
+                                    return to_numpy(without_gil([&]() { return tmt.diagram(e, label_ptr, val_ptr, negate, squash_root); }));
+                                }, "compute persistence diagram, as an N x 2 array of (birth, death)")
+        .def("pairings",        [to_edges](PyTMT& tmt, const EdgesArg& edges,  py::array_t<int64_t> labels,  py::array_t<Value> values, bool negate, bool squash_root, Value epsilon)
+                                {
+                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
+                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
+
+                                    auto&& e = to_edges(edges, tmt.size());
+                                    return to_numpy(without_gil([&]() { return tmt.pairings(e, label_ptr, val_ptr, negate, squash_root, epsilon); }));
+                                }, "compute persistence pairing, as (noisy pairs, pairs, noisy essential, essential): N x 2 and 1-D vertex arrays")
+        .def("simplify",        [to_edges](PyTMT& tmt, const EdgesArg& edges, py::array_t<int64_t> labels, py::array_t<Value> values, Value epsilon, bool negate, bool squash_root)
+                                {
+                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
+                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
+
+                                    auto&& e = to_edges(edges, tmt.size());
+                                    return to_numpy(without_gil([&]() { return tmt.simplify(e, label_ptr, val_ptr, epsilon, negate, squash_root); }));
+                                }, "simplify function on graph")
+        .def("simplify_ls",     [to_edges](PyTMT& tmt, const EdgesArg& edges, py::array_t<Value> values, Value epsilon, Value level_value, bool negate)
+                                {
+                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
+                                    auto&& e = to_edges(edges, tmt.size());
+                                    return to_numpy(without_gil([&]() { return tmt.simplify(e, val_ptr, epsilon, level_value, negate); }));
+                                }, "simplify level set of function on graph")
+    ;
+}
+
 template<class Value_, class Vertex_>
 void init_tmt(py::module& m, std::string suffix)
 {
@@ -88,7 +216,8 @@ void init_tmt(py::module& m, std::string suffix)
     using EdgeVector = typename std::vector<std::tuple<Vertex, Vertex>>;
 
     std::string classname = "TMT" + suffix;
-    py::class_<PyTMT>(m, classname.c_str(), "triplet merge tree")
+    py::class_<PyTMT> cls(m, classname.c_str(), "triplet merge tree");
+    cls
         .def(py::init<size_t, bool>())
         .def("__len__",         &PyTMT::size,               "size of the tree")
         .def("__contains__",    &PyTMT::contains,           "test whether the tree contains the vertex")
@@ -105,60 +234,79 @@ void init_tmt(py::module& m, std::string suffix)
                                 },                          "merge two vertices (i.e., add an edge to the domain)")
         .def("repair",          [](PyTMT& tmt)
                                 {
+                                    py::gil_scoped_release release;
                                     tmt.repair();
                                 },                          "repair the tree after a sequence of merges")
-        .def("representative",  &PyTMT::representative,     "find representative of a node at a given level")
+        .def("representative",  [](const PyTMT& tmt, Vertex u, Vertex a)
+                                {
+                                    return tmt.representative(u, a);
+                                },                          "find representative of a node at a given level")
         .def("value",           &PyTMT::value,              "function value of the given vertex")
         .def("__repr__",        [](const PyTMT& tmt)    { std::ostringstream oss; oss << "Tree with " << tmt.size() << " nodes"; return oss.str(); })
         .def("traverse_persistence",    [](const PyTMT& tmt)
                                         {
                                             std::vector<std::tuple<Vertex, Vertex, Vertex>> result;
+                                            py::gil_scoped_release release;
                                             tmt.traverse_persistence([&result](Vertex u, Vertex s, Vertex v) { result.emplace_back(u,s,v); });
                                             return result;
                                         },  "traverse persistence, return list of vertex triplets")
-        .def("clusters",        &clusters<PyTMT>, "k"_a, "find all clusters at the given threshold")
-        .def("compute_mt",      [](PyTMT& tmt, const EdgeVector& edges,  py::array_t<int64_t> labels,  py::array_t<Value> values, bool negate)
-                                {
-                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
-                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
-
-                                    tmt.compute_mt(edges, label_ptr, val_ptr, negate);
-                                }, "compute merge tree")
-
-        .def("n_components",    [](PyTMT& tmt, const EdgeVector& edges,  py::array_t<int64_t> labels)
-                                {
-                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
-
-                                    return tmt.n_components(edges, label_ptr);
-                                }, "compute number of connected components of domain")
-
-        .def("diagram",         [](PyTMT& tmt, const EdgeVector& edges,  py::array_t<int64_t> labels,  py::array_t<Value> values, bool negate, bool squash_root)
-                                {
-                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
-                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
-
-                                    return tmt.diagram(edges, label_ptr, val_ptr, negate, squash_root);
-                                }, "compute persistence diagram")
-        .def("pairings",        [](PyTMT& tmt, const EdgeVector& edges,  py::array_t<int64_t> labels,  py::array_t<Value> values, bool negate, bool squash_root, Value epsilon)
-                                {
-                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
-                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
-
-                                    return tmt.pairings(edges, label_ptr, val_ptr, negate, squash_root, epsilon);
-                                }, "compute persistence pairing")
-        .def("simplify",        [](PyTMT& tmt,  const EdgeVector& edges, py::array_t<int64_t> labels, py::array_t<Value> values, Value epsilon, bool negate, bool squash_root)
+        .def("persistence_intervals",   [](const PyTMT& tmt, bool sort, Value min_persistence)
+                                        {
+                                            auto intervals = without_gil([&]() { return tmt.persistence_intervals(sort, min_persistence); });
+                                            return py::make_tuple(to_numpy(std::move(intervals.births)),
+                                                                  to_numpy(std::move(intervals.deaths)),
+                                                                  to_numpy(std::move(intervals.persistence)),
+                                                                  to_numpy(std::move(intervals.vertices)));
+                                        },
+                                        "sort"_a = true, "min_persistence"_a = std::numeric_limits<Value>::lowest(),
+                                        "return (births, deaths, persistence, vertices) arrays of the non-zero persistence intervals, optionally sorted by decreasing persistence")
+        .def("cluster_labels",  [](const PyTMT& tmt, Value k, bool sizes) -> py::object
                                 {
-                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
-                                    int64_t* label_ptr = get_ptr_to_pyarray(labels, tmt.size(), true);
-
-                                    return tmt.simplify(edges, label_ptr, val_ptr, epsilon, negate, squash_root);
-                                }, "simplify function on graph")
-        .def("simplify_ls",     [](PyTMT& tmt,  const EdgeVector& edges, py::array_t<Value> values, Value epsilon, Value level_value, bool negate)
+                                    std::vector<int64_t> cluster_sizes;
+                                    auto labels = without_gil([&]() { return tmt.cluster_labels(k, sizes ? &cluster_sizes : nullptr); });
+                                    if (!sizes)
+                                        return to_numpy(std::move(labels));
+                                    return py::make_tuple(to_numpy(std::move(labels)), to_numpy(std::move(cluster_sizes)));
+                                },
+                                "k"_a, "sizes"_a = false,
+                                "label every vertex with the representative of its cluster at the given threshold (-1 below it); "
+                                "with sizes, also return the size of every cluster, indexed by its representative")
+        .def("cluster_sweep",   [](const PyTMT& tmt, py::array_t<Value, py::array::c_style | py::array::forcecast> thresholds, bool events) -> py::object
                                 {
-                                    Value* val_ptr = get_ptr_to_pyarray(values, tmt.size(), false);
-                                    return tmt.simplify(edges, val_ptr, epsilon, level_value, negate);
-                                }, "simplify level set of function on graph")
+                                    if (thresholds.ndim() != 1)
+                                        throw std::runtime_error("Expected 1D array.");
+                                    const Value* k     = thresholds.data();
+                                    size_t       count = thresholds.shape(0);
+
+                                    if (events)
+                                    {
+                                        auto e = without_gil([&]() { return tmt.cluster_events(k, count); });
+                                        return py::make_tuple(to_numpy(std::move(e.threshold)), to_numpy(std::move(e.from)), to_numpy(std::move(e.to)));
+                                    }
+
+                                    auto labels = without_gil([&]() { return tmt.cluster_labels(k, count); });
+                                    return adopt<int64_t>(std::move(labels), { count, tmt.size() });
+                                },
+                                "thresholds"_a, "events"_a = false,
+                                "clusters at all the (sorted) thresholds, in one pass: the matrix whose row t is cluster_labels(thresholds[t]); "
+                                "with events, the arrays (t, from, to) instead: at thresholds[t], the cluster labeled from gets labeled to (from == to: a new cluster)")
+        .def("clusters",        &clusters<PyTMT>, "k"_a, py::call_guard<py::gil_scoped_release>(), "find all clusters at the given threshold (vertices below it belong to none)")
         .def_property_readonly("negate", &PyTMT::negate,    "indicates whether the tree follows super- or sub-levelsets")
+        .def_property("threads", &PyTMT::threads, &PyTMT::set_threads,  "number of threads used by the parallel operations (0 = the default, see set_execution)")
+        .def_property("shortcut", &PyTMT::shortcut, &PyTMT::set_shortcut, "whether merges and repairs shortcut the triplets they walk past")
+        .def_property("presort", &PyTMT::presort, &PyTMT::set_presort, "whether compute_mt builds the tree over the vertices relabeled in sorted order")
+#if defined(NESOI_TMT_STATS)
+        .def("stats",           [](const PyTMT& tmt)
+                                {
+                                    auto stats = tmt.stats();
+                                    py::dict result;
+                                    result["walks"]     = stats.walks;
+                                    result["steps"]     = stats.steps;
+                                    result["shortcuts"] = stats.shortcuts;
+                                    return result;
+                                },                          "counts of the walks up the tree, the triplets they passed, and the shortcuts taken")
+        .def("reset_stats",     &PyTMT::reset_stats,        "reset the counts of the walks")
+#endif
         .def(py::pickle(
             [](const PyTMT& tmt)        // __getstate__
             {
@@ -191,4 +339,41 @@ void init_tmt(py::module& m, std::string suffix)
                 return tmt;
             }))
     ;
+
+    // arrays of these dtypes (C-contiguous) are read in place; any other array is converted by the first, int64, overload
+    def_analysis<PyTMT, typename EdgeArrayArg<std::int64_t>::Array>(cls,  EdgeArrayArg<std::int64_t>());
+    def_analysis<PyTMT, typename EdgeArrayArg<std::int32_t>::Array>(cls,  EdgeArrayArg<std::int32_t>());
+    def_analysis<PyTMT, typename EdgeArrayArg<std::uint32_t>::Array>(cls, EdgeArrayArg<std::uint32_t>());
+    def_analysis<PyTMT, typename EdgeArrayArg<std::uint64_t>::Array>(cls, EdgeArrayArg<std::uint64_t>());
+    def_analysis<PyTMT, nesoi::Grid>(cls, EdgeVectorArg());
+    def_analysis<PyTMT, EdgeVector>(cls, EdgeVectorArg());
+
+    // values given as a dense N-D array, whose shape determines the grid
+    using GridValues = py::array_t<Value, py::array::c_style | py::array::forcecast>;
+    auto grid = [](const PyTMT& tmt, const GridValues& values, py::object connectivity)
+    {
+        std::vector<size_t> shape(values.shape(), values.shape() + values.ndim());
+        nesoi::Grid g(shape, to_connectivity(shape.size(), connectivity));
+        if (g.size() != tmt.size())
+            throw std::runtime_error("Unexpected array size.");
+        return g;
+    };
+    cls
+        .def("compute_mt_grid", [grid](PyTMT& tmt, const GridValues& values, py::object connectivity, bool negate)
+                                {
+                                    nesoi::Grid g = grid(tmt, values, connectivity);
+                                    py::gil_scoped_release release;
+
+                                    tmt.compute_mt(g, nullptr, values.data(), negate);
+                                },
+                                "values"_a, "connectivity"_a = nesoi::GridConnectivity::face, "negate"_a = false,
+                                "compute merge tree of the function on a grid given by an N-D array of values")
+        .def("diagram_grid",    [grid](PyTMT& tmt, const GridValues& values, py::object connectivity, bool negate, bool squash_root)
+                                {
+                                    nesoi::Grid g = grid(tmt, values, connectivity);
+                                    return to_numpy(without_gil([&]() { return tmt.diagram(g, nullptr, values.data(), negate, squash_root); }));
+                                },
+                                "values"_a, "connectivity"_a = nesoi::GridConnectivity::face, "negate"_a = false, "squash_root"_a = false,
+                                "compute persistence diagram of the function on a grid given by an N-D array of values")
+    ;
 }
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+
+#include "parallel.h"
+
+namespace nesoi
+{
+
+// Neighbors of a grid vertex: along the axes (face: 4 in 2-D, 6 in 3-D), also
+// across the faces of the cells (edge: 8 in 2-D, 18 in 3-D), across everything
+// (full: 8 in 2-D, 26 in 3-D), or in the Freudenthal triangulation (6 in 2-D, 14 in 3-D)
+enum class GridConnectivity { face, edge, full, freudenthal };
+
+// connectivity with the given number of neighbors in the given dimension, e.g., 4 or 8 in 2-D, 6, 14, 18, or 26 in 3-D
+inline GridConnectivity grid_connectivity(size_t dimension, size_t neighbors)
+{
+    size_t full = 1;
+    for (size_t i = 0; i < dimension; ++i)
+        full *= 3;
+    full -= 1;
+
+    if (neighbors == 2*dimension)
+        return GridConnectivity::face;
+    else if (neighbors == full)
+        return GridConnectivity::full;
+    else if (neighbors == 2*dimension*dimension)
+        return GridConnectivity::edge;
+    else if (neighbors == 2*((size_t(1) << dimension) - 1))
+        return GridConnectivity::freudenthal;
+    throw std::runtime_error("No " + std::to_string(dimension) + "-D grid connectivity with " + std::to_string(neighbors) + " neighbors");
+}
+
+// Implicit graph on the vertices of a grid, stored in row-major order (the last axis varies fastest);
+// the edges are generated on the fly, and never stored
+class Grid
+{
+    public:
+                        Grid(const std::vector<size_t>& shape, GridConnectivity connectivity = GridConnectivity::face):
+                            shape_(shape), connectivity_(connectivity)          { init(); }
+
+        size_t          size() const                                            { return size_; }       // number of vertices
+        size_t          dimension() const                                       { return shape_.size(); }
+        const std::vector<size_t>&
+                        shape() const                                           { return shape_; }
+        GridConnectivity
+                        connectivity() const                                    { return connectivity_; }
+
+        // calls f(u,v) exactly once for every edge; in parallel, block by block along the rows
+        template<class F>
+        void            for_each_edge(const F& f, unsigned threads = 0) const;
+
+    private:
+        void            init();
+
+        struct Offset
+        {
+            std::vector<int>    d;              // per-axis offset
+            std::ptrdiff_t      delta;          // offset of the linear index
+        };
+
+        static constexpr size_t block = 4096;   // vertices of a row processed by one task
+
+    private:
+        std::vector<size_t>     shape_;
+        GridConnectivity        connectivity_;
+        size_t                  size_;
+        std::vector<Offset>     offsets_;       // one per pair of opposite neighbors: the first non-zero coordinate is positive
+};
+
+inline
+void
+Grid::
+init()
+{
+    size_ = 1;
+    for (size_t n : shape_)
+        size_ *= n;
+
+    size_t D = dimension();
+    if (D == 0)
+    {
+        size_ = 0;
+        return;
+    }
+
+    std::vector<std::ptrdiff_t> strides(D, 1);
+    for (size_t i = D - 1; i > 0; --i)
+        strides[i-1] = strides[i] * shape_[i];
+
+    // enumerate {-1,0,1}^D
+    std::vector<int> d(D, -1);
+    while (true)
+    {
+        size_t nonzero = 0, negative = 0;
+        int    first   = 0;
+        for (int x : d)
+        {
+            if (x != 0 && first == 0)
+                first = x;
+            nonzero  += (x != 0);
+            negative += (x < 0);
+        }
+
+        bool keep = first > 0;
+        switch (connectivity_)
+        {
+            case GridConnectivity::face:            keep = keep && nonzero == 1; break;
+            case GridConnectivity::edge:            keep = keep && nonzero <= 2; break;
+            case GridConnectivity::full:            break;
+            case GridConnectivity::freudenthal:     keep = keep && negative == 0; break;
+        }
+
+        if (keep)
+        {
+            std::ptrdiff_t delta = 0;
+            for (size_t i = 0; i < D; ++i)
+                delta += d[i] * strides[i];
+            offsets_.push_back(Offset { d, delta });
+        }
+
+        // next
+        size_t i = 0;
+        while (i < D && d[i] == 1)
+            d[i++] = -1;
+        if (i == D)
+            break;
+        ++d[i];
+    }
+}
+
+template<class F>
+void
+Grid::
+for_each_edge(const F& f, unsigned threads) const
+{
+    if (size_ == 0)
+        return;
+
+    size_t D      = dimension(),
+           last   = shape_[D-1],
+           rows   = size_ / last,
+           blocks = (last + block - 1) / block;
+
+    for_each(rows * blocks, [&](size_t t)
+    {
+        size_t row = t / blocks,
+               b   = (t % blocks) * block,
+               e   = std::min(b + block, last);
+
+        // coordinates of the row
+        std::vector<size_t> x(D - 1);
+        for (size_t i = D - 1, r = row; i > 0; --i)
+        {
+            x[i-1] = r % shape_[i-1];
+            r     /= shape_[i-1];
+        }
+
+        size_t base = row * last;
+        for (const Offset& o : offsets_)
+        {
+            bool inside = true;
+            for (size_t i = 0; i + 1 < D && inside; ++i)
+                inside = !(o.d[i] < 0 && x[i] == 0) && !(o.d[i] > 0 && x[i] + 1 == shape_[i]);
+            if (!inside)
+                continue;
+
+            size_t lo = std::max(b, size_t(o.d[D-1] < 0 ? 1 : 0)),
+                   hi = std::min(e, o.d[D-1] > 0 ? last - 1 : last);
+            for (size_t j = lo; j < hi; ++j)
+                f(base + j, base + j + o.delta);
+        }
+    }, threads);
+}
+
+}
@@ -1,10 +1,36 @@
 #pragma once
 
+#include <vector>
+#include <array>
+#include <tuple>
+#include <type_traits>
+
 #include "search-functors.h"
+#include "simd.h"
+#include "morton.h"
 
 namespace nesoi
 {
+    // Traits may fix the dimension at compile time by defining static_dimension (0 means dynamic)
+    template<class Traits>
+    struct StaticDimension
+    {
+        template<class T> static std::integral_constant<unsigned, T::static_dimension>  test(int);
+        template<class T> static std::integral_constant<unsigned, 0>                    test(...);
+
+        static constexpr unsigned value = decltype(test<Traits>(0))::value;
+    };
+
+    // order in which a batch of queries is processed (the results always follow the order of the queries):
+    // as given, by the leaf of the k-d tree that contains each query, or along the Morton curve
+    enum class QueryOrder { input, kdtree, morton };
+
     // Traits_ provides Coordinate, DistanceType, PointType, dimension(), distance(p1,p2), coordinate(p,i)
+    //
+    // With bucket_size > 1, the tree stops splitting once a node has at most
+    // bucket_size points, and copies the coordinates of every leaf into a
+    // contiguous block (structure-of-arrays) owned by the tree; distances are
+    // then evaluated directly from these blocks and are assumed to be Euclidean.
     template< class Traits_ >
     class KDTree
     {
@@ -21,13 +47,14 @@ namespace nesoi
             using Result            = HDContainer;
 
         public:
-                            KDTree(const Traits& traits):
-                                traits_(traits)                             {}
+            // threads = 0 uses the default of the execution context (see parallel.h)
+                            KDTree(const Traits& traits, size_t bucket_size = 1, unsigned threads = 0):
+                                traits_(traits), bucket_size_(bucket_size), threads_(threads)   {}
 
-                            KDTree(const Traits& traits, HandleContainer&& handles);
+                            KDTree(const Traits& traits, HandleContainer&& handles, size_t bucket_size = 1, unsigned threads = 0);
 
             template<class Range>
-                            KDTree(const Traits& traits, const Range& range);
+                            KDTree(const Traits& traits, const Range& range, size_t bucket_size = 1, unsigned threads = 0);
 
             template<class Range>
             void            init(const Range& range);
@@ -40,27 +67,165 @@ namespace nesoi
             Result          findR(const Point& q, DistanceType r) const     { return findR(traits().handle(q), r); }
             Result          findK(const Point& q, size_t k) const           { return findK(traits().handle(q), k); }
 
+            // neighbors of a batch of queries, in CSR form: the neighbors of queries[j], sorted by distance,
+            // are handles[offsets[j]], ..., handles[offsets[j+1] - 1], at the matching distances
+            struct Neighbors
+            {
+                HandleContainer             queries;
+                std::vector<size_t>         offsets;
+                HandleContainer             handles;
+                std::vector<DistanceType>   distances;
+            };
+
+            // the queries are processed in parallel, in the given order
+            Neighbors       findR(const HandleContainer& queries, DistanceType r, QueryOrder order = QueryOrder::kdtree) const;
+            Neighbors       findK(const HandleContainer& queries, size_t k, QueryOrder order = QueryOrder::kdtree) const;
+
+            // every point of the tree is a query; the rows follow the order of the tree
+            Neighbors       findR_all(DistanceType r) const                 { return batch(tree_, QueryOrder::input, nesoi::rNNRecord<HandleDistance>(r)); }
+            Neighbors       findK_all(size_t k) const                       { return batch(tree_, QueryOrder::input, nesoi::kNNRecord<HandleDistance>(k)); }
+
+            // radius queries that never materialize the neighbors; f is called with the PointHandle of every point within r
+            size_t          countR(PointHandle q, DistanceType r) const;
+            template<class F>
+            void            for_each_in_radius(PointHandle q, DistanceType r, const F& f) const;
+
+            size_t          countR(const Point& q, DistanceType r) const    { return countR(traits().handle(q), r); }
+            template<class F>
+            void            for_each_in_radius(const Point& q, DistanceType r, const F& f) const
+                                                                            { for_each_in_radius(traits().handle(q), r, f); }
+
+            // dual-tree self-join: calls f(p,q) exactly once for every unordered pair of distinct points within r of each other;
+            // the pairs are produced in parallel, so f must be thread-safe
+            template<class F>
+            void            self_join(DistanceType r, const F& f) const;
+
             template<class ResultsFunctor>
             void            search(PointHandle q, ResultsFunctor& rf) const;
 
             const Traits&   traits() const                                  { return traits_; }
+            size_t          bucket_size() const                             { return bucket_size_; }
+            unsigned        threads() const                                 { return threads_; }
+            void            set_threads(unsigned threads)                   { threads_ = threads; }
 
         private:
             void            init();
 
-            using HCIterator = typename HandleContainer::iterator;
-            using KDTreeNode = std::tuple<HCIterator, HCIterator, size_t>;
+            using HCIterator        = typename HandleContainer::iterator;
+            using HCConstIterator   = typename HandleContainer::const_iterator;
+            using KDTreeNode        = std::tuple<HCIterator, HCIterator, size_t>;
+            static constexpr unsigned static_dimension = StaticDimension<Traits>::value;
+            using Coordinates       = typename std::conditional<static_dimension == 0,
+                                                                std::vector<Coordinate>,
+                                                                std::array<Coordinate, static_dimension>>::type;
+
+            struct Query
+            {
+                PointHandle                 q;
+                Coordinates                 point;          // coordinates of q
+                Coordinates                 offsets;        // per-axis offsets from q to the current cell
+                std::vector<DistanceType>   distances;      // scratch space for leaf scans
+                DistanceType                D;              // current search radius
+                Coordinates                 lower, upper;   // bounds of the current cell (radius queries only)
+            };
+
+            struct Cell
+            {
+                HCConstIterator             b, e;
+                size_t                      i;              // splitting axis
+                Coordinates                 lower, upper;   // bounds
+            };
+
+            static constexpr size_t join_cutoff = 16;   // cells of at most join_cutoff*bucket_size_ points are joined point-by-point
+
+            struct JoinTask
+            {
+                Cell                        a, b;
+                bool                        self;           // pairs within a (b is ignored), or pairs across a and b
+            };
 
             void            sort_all(HCIterator b, HCIterator e, size_t i);
             void            sort_all_threads(HCIterator b, HCIterator e, size_t i, unsigned threads);
             HCIterator      sort(HCIterator b, HCIterator e, size_t i);
 
+            void            copy_coordinates();
+            bool            leaf(HCConstIterator b, HCConstIterator e) const    { return static_cast<size_t>(e - b) <= bucket_size_; }
+            const Coordinate*
+                            block(HCConstIterator b) const                      { return &coordinates_[(b - tree_.begin()) * traits().dimension()]; }
+
+            template<class ResultsFunctor>
+            void            search(PointHandle q, Query& query, ResultsFunctor& rf) const;
+
+            template<class Record>
+            Neighbors       batch(const HandleContainer& queries, QueryOrder order, const Record& record) const;
+            size_t          locate(PointHandle q) const;
+
+            void            prepare(Query& query, PointHandle q) const;
+            void            prepare(Query& query, PointHandle q, DistanceType r) const;
+
+            template<class ResultsFunctor>
+            void            search(HCConstIterator b, HCConstIterator e, size_t i,
+                                   DistanceType rd, Query& query, ResultsFunctor& rf) const;
+
+            template<class ResultsFunctor>
+            void            scan(HCConstIterator b, HCConstIterator e, Query& query, ResultsFunctor& rf) const;
+
+            template<class PointFunctor, class CellFunctor>
+            void            range(HCConstIterator b, HCConstIterator e, size_t i,
+                                  DistanceType rd, Query& query,
+                                  const PointFunctor& fp, const CellFunctor& fc) const;
+
+            template<class PointFunctor>
+            void            range_scan(HCConstIterator b, HCConstIterator e, Query& query, const PointFunctor& fp) const;
+
+            Cell            root() const                                        { return Cell { tree_.begin(), tree_.end(), 0, lower_, upper_ }; }
+            HCConstIterator split(const Cell& c, Cell& left, Cell& right) const;
+
+            template<class F>
+            bool            expand(const JoinTask& task, DistanceType r, Query& query, const F& f, std::vector<JoinTask>& tasks) const;
+            template<class F>
+            void            join(const Cell& a, DistanceType r, Query& query, const F& f) const;
+            template<class F>
+            void            join(const Cell& a, const Cell& b, DistanceType r, Query& query, const F& f) const;
+            template<class F>
+            void            join(PointHandle p, const Cell& b, DistanceType r, Query& query, const F& f) const;
+            template<class F>
+            void            join(HCConstIterator b, HCConstIterator e, const Cell& c, DistanceType r, Query& query, const F& f) const;
+            template<class F>
+            void            join_leaves(const Cell& a, const Cell& b, bool self, DistanceType r, Query& query, const F& f) const;
+
+            DistanceType    near_distance(const Cell& a, const Cell& b) const;
+            bool            inside(const Cell& a, const Cell& b, DistanceType r) const;
+
+            Coordinate      diff(const Query& query, HCConstIterator m, size_t i) const;
+            Coordinate      coordinate(HCConstIterator m, size_t i) const;
+
+            // offsets from q to the nearest and the farthest sides of the cell [query.lower, query.upper] along axis c
+            static Coordinate
+                            near_offset(const Query& query, size_t c)           { return std::max(std::max(query.lower[c] - query.point[c], query.point[c] - query.upper[c]), Coordinate(0)); }
+            static Coordinate
+                            far_offset(const Query& query, size_t c)            { return std::max(query.point[c] - query.lower[c], query.upper[c] - query.point[c]); }
+            DistanceType    near_distance(const Query& query) const;
+
+            static bool     prune(DistanceType rd, DistanceType D);
+            bool            inside(const Query& query) const;
+
+            size_t          next_axis(size_t i) const                           { return i + 1 == traits().dimension() ? 0 : i + 1; }
+
+            static void     reset(std::vector<Coordinate>& x, size_t dim)       { x.assign(dim, 0); }
+            template<size_t D>
+            static void     reset(std::array<Coordinate, D>& x, size_t)         { x.fill(0); }
+
             struct CoordinateComparison;
             struct OrderTree;
 
         private:
-            Traits          traits_;
-            HandleContainer tree_;
+            Traits                  traits_;
+            size_t                  bucket_size_;
+            unsigned                threads_;
+            HandleContainer         tree_;
+            std::vector<Coordinate> coordinates_;       // leaf blocks, in the order of tree_; empty if bucket_size_ == 1
+            Coordinates             lower_, upper_;     // bounding box of all the points
     };
 }
 
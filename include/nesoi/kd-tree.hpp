@@ -1,24 +1,21 @@
 #include <queue>
 #include <stack>
+#include <cmath>
+#include <numeric>
 
-#if !defined(NESOI_NO_PARALLEL)
-#include <thread>
-#include <future>
-#endif
-
-#include <iostream>
+#include "parallel.h"
 
 template<class T>
 nesoi::KDTree<T>::
-KDTree(const Traits& traits, HandleContainer&& handles):
-    traits_(traits), tree_(std::move(handles))
+KDTree(const Traits& traits, HandleContainer&& handles, size_t bucket_size, unsigned threads):
+    traits_(traits), bucket_size_(bucket_size), threads_(threads), tree_(std::move(handles))
 { init(); }
 
 template<class T>
 template<class Range>
 nesoi::KDTree<T>::
-KDTree(const Traits& traits, const Range& range):
-    traits_(traits)
+KDTree(const Traits& traits, const Range& range, size_t bucket_size, unsigned threads):
+    traits_(traits), bucket_size_(bucket_size), threads_(threads)
 {
     init(range);
 }
@@ -50,10 +47,24 @@ init()
 #if defined(NESOI_NO_PARALLEL)
     sort_all(b,e,i);
 #else
-    unsigned threads = std::thread::hardware_concurrency();
-    std::cerr << "Building k-d tree using " << threads << " threads" << std::endl;
-    sort_all_threads(b,e,i,threads);
+    sort_all_threads(b,e,i,nesoi::concurrency(threads_));
 #endif
+
+    if (bucket_size_ > 1)
+        copy_coordinates();
+
+    size_t dim = traits().dimension();
+    reset(lower_, dim);
+    reset(upper_, dim);
+    for (size_t c = 0; c < dim; ++c)
+        lower_[c] = upper_[c] = traits().coordinate(tree_[0], c);
+    for (PointHandle h : tree_)
+        for (size_t c = 0; c < dim; ++c)
+        {
+            Coordinate x = traits().coordinate(h, c);
+            lower_[c] = std::min(lower_[c], x);
+            upper_[c] = std::max(upper_[c], x);
+        }
 }
 
 #if !defined(NESOI_NO_PARALLEL)
@@ -68,23 +79,42 @@ sort_all_threads(HCIterator b, HCIterator e, size_t i, unsigned threads)
         return;
     }
 
-    HCIterator m = sort(b,e,i);
-
-    size_t next_i = (i + 1) % traits().dimension();
+    // split the top of the tree level by level, the nodes of a level in parallel, on the pool (so within the execution
+    // context), until there are enough subtrees to balance; then sort the subtrees in parallel
+    size_t target = 16 * threads;
+    std::vector<KDTreeNode> nodes;
+    if (!leaf(b,e))
+        nodes.emplace_back(b,e,i);
+    while (!nodes.empty() && nodes.size() < target)
+    {
+        std::vector<KDTreeNode> children(2*nodes.size());
+        std::vector<char>       split(2*nodes.size(), 0);
+        nesoi::for_each(nodes.size(), [&](size_t j)
+        {
+            HCIterator b, e; size_t i;
+            std::tie(b,e,i) = nodes[j];
+
+            HCIterator m = sort(b,e,i);
+
+            size_t next_i = next_axis(i);
+            children[2*j]     = KDTreeNode(b,m,next_i);
+            children[2*j + 1] = KDTreeNode(m+1,e,next_i);
+            split[2*j]        = !leaf(b,m);
+            split[2*j + 1]    = !leaf(m+1,e);
+        }, threads);
+
+        nodes.clear();
+        for (size_t j = 0; j < children.size(); ++j)
+            if (split[j])
+                nodes.push_back(children[j]);
+    }
 
-    std::vector<std::future<void>> handles;
-    if (b < m - 1)
-        handles.emplace_back(std::async(std::launch::async,
-                                        [this,b,m,e,next_i,threads]()
-                                        {
-                                            sort_all_threads(b,m,next_i,threads/2);
-                                        }));
-    if (e - m > 2)
-        handles.emplace_back(std::async(std::launch::async,
-                                        [this,b,m,e,next_i,threads]()
-                                        {
-                                            sort_all_threads(m+1,e,next_i,threads - threads/2);
-                                        }));
+    nesoi::for_each(nodes.size(), [&](size_t j)
+    {
+        HCIterator b, e; size_t i;
+        std::tie(b,e,i) = nodes[j];
+        sort_all(b,e,i);
+    }, threads);
 }
 #endif
 
@@ -102,13 +132,55 @@ sort_all(HCIterator b, HCIterator e, size_t i)
         std::tie(b,e,i) = q.front();
         q.pop();
 
+        if (leaf(b,e))
+            continue;
+
         HCIterator m = sort(b,e,i);
 
-        size_t next_i = (i + 1) % traits().dimension();
+        size_t next_i = next_axis(i);
 
-        // Replace with a size condition instead?
-        if (b < m - 1)  q.push(KDTreeNode(b,   m, next_i));
-        if (e - m > 2)  q.push(KDTreeNode(m+1, e, next_i));
+        if (!leaf(b,m))     q.push(KDTreeNode(b,   m, next_i));
+        if (!leaf(m+1,e))   q.push(KDTreeNode(m+1, e, next_i));
+    }
+}
+
+// Lay out coordinates in the order of tree_: every leaf [b,e) gets a block
+// with axis c of point j at c*(e-b) + j; every internal median gets a block of one point
+template<class T>
+void
+nesoi::KDTree<T>::
+copy_coordinates()
+{
+    size_t dim = traits().dimension();
+    coordinates_.resize(tree_.size() * dim);
+
+    auto copy_block = [this,dim](HCConstIterator b, HCConstIterator e)
+    {
+        size_t      n     = e - b;
+        Coordinate* block = &coordinates_[(b - tree_.begin()) * dim];
+        for (size_t c = 0; c < dim; ++c)
+            for (size_t j = 0; j < n; ++j)
+                block[c*n + j] = traits().coordinate(b[j], c);
+    };
+
+    std::stack<std::pair<HCConstIterator, HCConstIterator>> nodes;
+    nodes.emplace(tree_.begin(), tree_.end());
+    while (!nodes.empty())
+    {
+        HCConstIterator b, e;
+        std::tie(b,e) = nodes.top();
+        nodes.pop();
+
+        if (leaf(b,e))
+        {
+            copy_block(b,e);
+            continue;
+        }
+
+        HCConstIterator m = b + (e - b)/2;
+        copy_block(m, m+1);
+        nodes.emplace(b,   m);
+        nodes.emplace(m+1, e);
     }
 }
 
@@ -129,38 +201,737 @@ void
 nesoi::KDTree<T>::
 search(PointHandle q, ResultsFunctor& rf) const
 {
-    typedef         typename HandleContainer::const_iterator        HCIterator;
-    typedef         std::tuple<HCIterator, HCIterator, size_t>      KDTreeNode;
+    if (tree_.empty())
+        return;
+
+    Query query;
+    search(q, query, rf);
+}
 
+template<class T>
+template<class ResultsFunctor>
+void
+nesoi::KDTree<T>::
+search(PointHandle q, Query& query, ResultsFunctor& rf) const
+{
     if (tree_.empty())
         return;
 
-    DistanceType    D  = std::numeric_limits<DistanceType>::infinity();
+    prepare(query, q);
+    search(tree_.begin(), tree_.end(), 0, 0, query, rf);
+}
+
+template<class T>
+typename nesoi::KDTree<T>::Neighbors
+nesoi::KDTree<T>::
+findR(const HandleContainer& queries, DistanceType r, QueryOrder order) const
+{
+    return batch(queries, order, nesoi::rNNRecord<HandleDistance>(r));
+}
+
+template<class T>
+typename nesoi::KDTree<T>::Neighbors
+nesoi::KDTree<T>::
+findK(const HandleContainer& queries, size_t k, QueryOrder order) const
+{
+    return batch(queries, order, nesoi::kNNRecord<HandleDistance>(k));
+}
 
-    std::queue<KDTreeNode>  nodes;
-    nodes.push(KDTreeNode(tree_.begin(), tree_.end(), 0));
+// Runs a copy of record for every query, visiting the queries in the given
+// order. Each chunk of that order collects its results contiguously, reusing
+// one Query and one record; the chunks are then scattered into the rows.
+template<class T>
+template<class Record>
+typename nesoi::KDTree<T>::Neighbors
+nesoi::KDTree<T>::
+batch(const HandleContainer& queries, QueryOrder query_order, const Record& record) const
+{
+    size_t m = queries.size();
 
-    while (!nodes.empty())
+    std::vector<size_t> order(m);
+    std::iota(order.begin(), order.end(), 0);
+    if (query_order == QueryOrder::kdtree && !tree_.empty())
     {
-        HCIterator b, e; size_t i;
-        std::tie(b,e,i) = nodes.front();
-        nodes.pop();
+        std::vector<size_t> leaves(m);
+        nesoi::for_each(m, [&](size_t j) { leaves[j] = locate(queries[j]); }, threads_);
+        std::stable_sort(order.begin(), order.end(), [&leaves](size_t x, size_t y) { return leaves[x] < leaves[y]; });
+    } else if (query_order == QueryOrder::morton)
+    {
+        // sort positions of queries, rather than the queries themselves
+        struct Positions
+        {
+            using Coordinate    = typename KDTree::Coordinate;
+
+            unsigned            dimension() const                       { return traits.dimension(); }
+            Coordinate          coordinate(size_t j, size_t i) const    { return traits.coordinate(queries[j], i); }
+
+            const Traits&           traits;
+            const HandleContainer&  queries;
+        };
+        nesoi::morton_sort(Positions { traits(), queries }, order);
+    }
+
+    struct Chunk
+    {
+        std::vector<size_t>     counts;
+        HDContainer             results;
+    };
+    static constexpr size_t chunk_size = 256;
+    std::vector<Chunk> chunks((m + chunk_size - 1) / chunk_size);
+
+    nesoi::for_each(chunks.size(), [&](size_t c)
+    {
+        Query   query;
+        Record  rec   = record;
+        Chunk&  chunk = chunks[c];
+        size_t  b     = c * chunk_size,
+                e     = std::min(b + chunk_size, m);
+
+        chunk.counts.reserve(e - b);
+        for (size_t x = b; x < e; ++x)
+        {
+            rec.result.clear();
+            search(queries[order[x]], query, rec);
+            std::sort(rec.result.begin(), rec.result.end());
+            chunk.counts.push_back(rec.result.size());
+            chunk.results.insert(chunk.results.end(), rec.result.begin(), rec.result.end());
+        }
+    }, threads_);
+
+    Neighbors neighbors;
+    neighbors.queries = queries;
+    neighbors.offsets.assign(m + 1, 0);
+    for (size_t c = 0; c < chunks.size(); ++c)
+        for (size_t x = 0; x < chunks[c].counts.size(); ++x)
+            neighbors.offsets[order[c * chunk_size + x] + 1] = chunks[c].counts[x];
+    std::partial_sum(neighbors.offsets.begin(), neighbors.offsets.end(), neighbors.offsets.begin());
+
+    neighbors.handles.resize(neighbors.offsets[m]);
+    neighbors.distances.resize(neighbors.offsets[m]);
+    nesoi::for_each(chunks.size(), [&](size_t c)
+    {
+        const Chunk& chunk = chunks[c];
+        auto it = chunk.results.begin();
+        for (size_t x = 0; x < chunk.counts.size(); ++x)
+        {
+            size_t offset = neighbors.offsets[order[c * chunk_size + x]];
+            for (size_t j = 0; j < chunk.counts[x]; ++j, ++it)
+            {
+                neighbors.handles[offset + j]   = it->p;
+                neighbors.distances[offset + j] = it->d;
+            }
+        }
+    }, threads_);
+
+    return neighbors;
+}
+
+// position in tree_ of the leaf whose cell contains q
+template<class T>
+size_t
+nesoi::KDTree<T>::
+locate(PointHandle q) const
+{
+    HCConstIterator b = tree_.begin(),
+                    e = tree_.end();
+    size_t          i = 0;
+    while (!leaf(b,e))
+    {
+        HCConstIterator m = b + (e - b)/2;
+        if (traits().coordinate(q, i) < coordinate(m, i))
+            e = m;
+        else
+            b = m + 1;
+        i = next_axis(i);
+    }
+    return b - tree_.begin();
+}
+
+template<class T>
+void
+nesoi::KDTree<T>::
+prepare(Query& query, PointHandle q) const
+{
+    size_t dim = traits().dimension();
+
+    query.q = q;
+    query.D = std::numeric_limits<DistanceType>::infinity();
+    reset(query.offsets, dim);
+    reset(query.point, dim);
+    for (size_t c = 0; c < dim; ++c)
+        query.point[c] = traits().coordinate(q, c);
+
+    if (!coordinates_.empty())
+        query.distances.resize(bucket_size_);
+}
+
+// Depth-first, nearest child first; rd is the squared distance from q to the
+// cell [b,e), maintained incrementally from the per-axis offsets (Arya-Mount)
+template<class T>
+template<class ResultsFunctor>
+void
+nesoi::KDTree<T>::
+search(HCConstIterator b, HCConstIterator e, size_t i,
+       DistanceType rd, Query& query, ResultsFunctor& rf) const
+{
+    if (prune(rd, query.D))     // D may have shrunk since the parent scheduled us
+        return;
+
+    if (leaf(b,e))
+    {
+        scan(b, e, query, rf);
+        return;
+    }
+
+    HCConstIterator m = b + (e - b)/2;
+    scan(m, m+1, query, rf);
+
+    Coordinate diff = this->diff(query, m, i);      // diff returns signed distance
+    size_t next_i = next_axis(i);
+
+    HCConstIterator near_b = b,     near_e = m,
+                    far_b  = m + 1, far_e  = e;
+    if (diff >= 0)
+    {
+        std::swap(near_b, far_b);
+        std::swap(near_e, far_e);
+    }
+
+    if (near_b < near_e)
+        search(near_b, near_e, next_i, rd, query, rf);
+
+    if (far_b < far_e)
+    {
+        Coordinate&  offset = query.offsets[i];
+        Coordinate   old    = offset;
+        DistanceType far_rd = rd - old*old + diff*diff;
+        if (!prune(far_rd, query.D))
+        {
+            offset = diff;
+            search(far_b, far_e, next_i, far_rd, query, rf);
+            offset = old;
+        }
+    }
+}
+
+template<class T>
+template<class ResultsFunctor>
+void
+nesoi::KDTree<T>::
+scan(HCConstIterator b, HCConstIterator e, Query& query, ResultsFunctor& rf) const
+{
+    if (coordinates_.empty())
+    {
+        for (HCConstIterator it = b; it != e; ++it)
+            query.D = rf(*it, traits().distance(query.q, *it));
+        return;
+    }
+
+    size_t              n     = e - b;
+    size_t              dim   = traits().dimension();
+    const Coordinate*   x     = block(b);
+    DistanceType*       dist  = &query.distances[0];
+
+    simd::sq_distances(&query.point[0], x, dim, n, dist);
+
+    for (size_t j = 0; j < n; ++j)
+        query.D = rf(b[j], std::sqrt(dist[j]));
+}
+
+template<class T>
+typename nesoi::KDTree<T>::Coordinate
+nesoi::KDTree<T>::
+diff(const Query& query, HCConstIterator m, size_t i) const
+{
+    return query.point[i] - coordinate(m, i);
+}
+
+template<class T>
+typename nesoi::KDTree<T>::Coordinate
+nesoi::KDTree<T>::
+coordinate(HCConstIterator m, size_t i) const
+{
+    if (coordinates_.empty())
+        return traits().coordinate(*m, i);
+    else
+        return block(m)[i];
+}
+
+template<class T>
+void
+nesoi::KDTree<T>::
+prepare(Query& query, PointHandle q, DistanceType r) const
+{
+    prepare(query, q);
+    query.D     = r;
+    query.lower = lower_;
+    query.upper = upper_;
+}
+
+template<class T>
+size_t
+nesoi::KDTree<T>::
+countR(PointHandle q, DistanceType r) const
+{
+    size_t count = 0;
+    if (tree_.empty())
+        return count;
+
+    Query query;
+    prepare(query, q, r);
+    range(tree_.begin(), tree_.end(), 0, near_distance(query), query,
+          [&count](PointHandle)                             { ++count; },
+          [&count](HCConstIterator b, HCConstIterator e)    { count += e - b; });
+    return count;
+}
+
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+for_each_in_radius(PointHandle q, DistanceType r, const F& f) const
+{
+    if (tree_.empty())
+        return;
+
+    Query query;
+    prepare(query, q, r);
+    range(tree_.begin(), tree_.end(), 0, near_distance(query), query,
+          [&f](PointHandle p)                               { f(p); },
+          [&f](HCConstIterator b, HCConstIterator e)        { for (HCConstIterator it = b; it != e; ++it) f(*it); });
+}
+
+// Radius query over the cell [b,e) with bounds [query.lower, query.upper];
+// rd is the squared distance from q to the cell, updated incrementally as the
+// bounds tighten. Cells that lie entirely inside the ball are reported as a
+// whole via fc.
+template<class T>
+template<class PointFunctor, class CellFunctor>
+void
+nesoi::KDTree<T>::
+range(HCConstIterator b, HCConstIterator e, size_t i,
+      DistanceType rd, Query& query,
+      const PointFunctor& fp, const CellFunctor& fc) const
+{
+    if (prune(rd, query.D))
+        return;
+
+    if (inside(query))
+    {
+        fc(b,e);
+        return;
+    }
+
+    if (leaf(b,e))
+    {
+        range_scan(b, e, query, fp);
+        return;
+    }
+
+    HCConstIterator m = b + (e - b)/2;
+    range_scan(m, m+1, query, fp);
+
+    Coordinate split  = coordinate(m, i);
+    Coordinate diff   = query.point[i] - split;
+    Coordinate offset = near_offset(query, i);
+    size_t     next_i = next_axis(i);
+
+    // the near child keeps the offset along axis i, the far one moves to the split
+    HCConstIterator near_b = b,     near_e = m,
+                    far_b  = m + 1, far_e  = e;
+    Coordinate*     near_bound = &query.upper[i];
+    Coordinate*     far_bound  = &query.lower[i];
+    if (diff >= 0)
+    {
+        std::swap(near_b, far_b);
+        std::swap(near_e, far_e);
+        std::swap(near_bound, far_bound);
+    }
+
+    if (near_b < near_e)
+    {
+        Coordinate old = *near_bound;
+        *near_bound = split;
+        range(near_b, near_e, next_i, rd, query, fp, fc);
+        *near_bound = old;
+    }
+
+    if (far_b < far_e)
+    {
+        DistanceType far_rd = rd - offset*offset + diff*diff;
+        if (!prune(far_rd, query.D))
+        {
+            Coordinate old = *far_bound;
+            *far_bound = split;
+            range(far_b, far_e, next_i, far_rd, query, fp, fc);
+            *far_bound = old;
+        }
+    }
+}
+
+template<class T>
+typename nesoi::KDTree<T>::DistanceType
+nesoi::KDTree<T>::
+near_distance(const Query& query) const
+{
+    DistanceType rd = 0;
+    for (size_t c = 0; c < traits().dimension(); ++c)
+    {
+        Coordinate x = near_offset(query, c);
+        rd += x*x;
+    }
+    return rd;
+}
+
+template<class T>
+template<class PointFunctor>
+void
+nesoi::KDTree<T>::
+range_scan(HCConstIterator b, HCConstIterator e, Query& query, const PointFunctor& fp) const
+{
+    if (coordinates_.empty())
+    {
+        for (HCConstIterator it = b; it != e; ++it)
+            if (traits().distance(query.q, *it) <= query.D)
+                fp(*it);
+        return;
+    }
+
+    size_t          n    = e - b;
+    DistanceType*   dist = &query.distances[0];
+
+    simd::sq_distances(&query.point[0], block(b), traits().dimension(), n, dist);
+
+    for (size_t j = 0; j < n; ++j)
+        if (std::sqrt(dist[j]) <= query.D)
+            fp(b[j]);
+}
 
-        CoordinateComparison cmp(i, traits());
-        i = (i + 1) % traits().dimension();
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+self_join(DistanceType r, const F& f) const
+{
+    if (tree_.empty())
+        return;
 
-        HCIterator m = b + (e - b)/2;
-        DistanceType dist = traits().distance(q, *m);
-        D = rf(*m, dist);
+    Query query;
+    prepare(query, tree_[0], r);
 
-        // we are really searching w.r.t L_\infty ball; could prune better with an L_2 ball
-        Coordinate diff = cmp.diff(q, *m);     // diff returns signed distance
-        if (e > m + 1 && diff >= -D)
-            nodes.push(KDTreeNode(m+1, e, i));
+    // unroll the top of the recursion into independent tasks, then process them in parallel
+    size_t target = nesoi::concurrency(threads_) > 1 ? 16 * nesoi::concurrency(threads_) : 1;
+    std::vector<JoinTask> tasks { JoinTask { root(), root(), true } };
+    bool expanded = true;
+    while (expanded && tasks.size() < target)
+    {
+        expanded = false;
+        std::vector<JoinTask> next;
+        for (const JoinTask& task : tasks)
+            if (expand(task, r, query, f, next))
+                expanded = true;
+            else
+                next.push_back(task);
+        tasks.swap(next);
+    }
+
+    nesoi::for_each(tasks.size(), [&](size_t t)
+    {
+        Query query;
+        prepare(query, tree_[0], r);
+
+        const JoinTask& task = tasks[t];
+        if (task.self)
+            join(task.a, r, query, f);
+        else
+            join(task.a, task.b, r, query, f);
+    }, threads_);
+}
+
+// Performs one step of the recursion of join() on the task, appending the subtasks;
+// returns false if the task cannot be split any further
+template<class T>
+template<class F>
+bool
+nesoi::KDTree<T>::
+expand(const JoinTask& task, DistanceType r, Query& query, const F& f, std::vector<JoinTask>& tasks) const
+{
+    Cell left, right;
+    if (task.self)
+    {
+        if (leaf(task.a.b, task.a.e))
+            return false;
+
+        HCConstIterator m = split(task.a, left, right);
+        for (size_t i = 0; i < traits().dimension(); ++i)
+            query.point[i] = coordinate(m, i);
+        if (left.b < left.e)    join(*m, left,  r, query, f);
+        if (right.b < right.e)  join(*m, right, r, query, f);
+
+        if (left.b < left.e)    tasks.push_back(JoinTask { left,  left,  true });
+        if (right.b < right.e)  tasks.push_back(JoinTask { right, right, true });
+        if (left.b < left.e && right.b < right.e)
+            tasks.push_back(JoinTask { left, right, false });
+        return true;
+    }
+
+    if (prune(near_distance(task.a, task.b), r))
+        return true;
+
+    bool leaf_a = leaf(task.a.b, task.a.e),
+         leaf_b = leaf(task.b.b, task.b.e);
+    if (leaf_a && leaf_b)
+        return false;
+
+    // split the larger cell
+    bool split_a = !leaf_a && (leaf_b || task.a.e - task.a.b >= task.b.e - task.b.b);
+    const Cell& c     = split_a ? task.a : task.b;
+    const Cell& other = split_a ? task.b : task.a;
+
+    HCConstIterator m = split(c, left, right);
+    for (size_t i = 0; i < traits().dimension(); ++i)
+        query.point[i] = coordinate(m, i);
+    join(*m, other, r, query, f);
+    if (left.b < left.e)    tasks.push_back(JoinTask { left,  other, false });
+    if (right.b < right.e)  tasks.push_back(JoinTask { right, other, false });
+    return true;
+}
 
-        if (b < m && diff <= D)
-            nodes.push(KDTreeNode(b,   m, i));
+// all pairs within the cell a
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+join(const Cell& a, DistanceType r, Query& query, const F& f) const
+{
+    if (leaf(a.b, a.e))
+    {
+        join_leaves(a, a, true, r, query, f);
+        return;
+    }
+
+    Cell left, right;
+    HCConstIterator m = split(a, left, right);
+    for (size_t i = 0; i < traits().dimension(); ++i)
+        query.point[i] = coordinate(m, i);
+    if (left.b < left.e)    join(*m, left,  r, query, f);
+    if (right.b < right.e)  join(*m, right, r, query, f);
+    if (left.b < left.e)    join(left,  r, query, f);
+    if (right.b < right.e)  join(right, r, query, f);
+    if (left.b < left.e && right.b < right.e)
+        join(left, right, r, query, f);
+}
+
+// all pairs across the (disjoint) cells a and b
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+join(const Cell& a, const Cell& b, DistanceType r, Query& query, const F& f) const
+{
+    if (prune(near_distance(a, b), r))
+        return;
+
+    if (inside(a, b, r))
+    {
+        for (HCConstIterator x = a.b; x != a.e; ++x)
+            for (HCConstIterator y = b.b; y != b.e; ++y)
+                f(*x, *y);
+        return;
+    }
+
+    bool leaf_a = leaf(a.b, a.e),
+         leaf_b = leaf(b.b, b.e);
+    if (leaf_a && leaf_b)
+    {
+        join_leaves(a, b, false, r, query, f);
+        return;
+    }
+
+    // a point-vs-cell bound is tighter than a cell-vs-cell one, so once one side
+    // is small, query each of its points against the other side
+    if (std::min(a.e - a.b, b.e - b.b) <= static_cast<std::ptrdiff_t>(join_cutoff*bucket_size_))
+    {
+        bool        small_a = a.e - a.b <= b.e - b.b;
+        const Cell& l       = small_a ? a : b;
+        join(l.b, l.e, small_a ? b : a, r, query, f);
+        return;
+    }
+
+    // split the larger cell
+    bool split_a = a.e - a.b >= b.e - b.b;
+    const Cell& c     = split_a ? a : b;
+    const Cell& other = split_a ? b : a;
+
+    Cell left, right;
+    HCConstIterator m = split(c, left, right);
+    for (size_t i = 0; i < traits().dimension(); ++i)
+        query.point[i] = coordinate(m, i);
+    join(*m, other, r, query, f);
+    if (left.b < left.e)    join(left,  other, r, query, f);
+    if (right.b < right.e)  join(right, other, r, query, f);
+}
+
+// pairs between every point of the subtree [b,e) and the points of the cell c
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+join(HCConstIterator b, HCConstIterator e, const Cell& c, DistanceType r, Query& query, const F& f) const
+{
+    size_t dim = traits().dimension();
+    if (leaf(b,e))
+    {
+        size_t n = e - b;
+        for (size_t j = 0; j < n; ++j)
+        {
+            for (size_t i = 0; i < dim; ++i)
+                query.point[i] = coordinates_.empty() ? traits().coordinate(b[j], i) : block(b)[i*n + j];
+            join(b[j], c, r, query, f);
+        }
+        return;
+    }
+
+    HCConstIterator m = b + (e - b)/2;
+    for (size_t i = 0; i < dim; ++i)
+        query.point[i] = coordinate(m, i);
+    join(*m, c, r, query, f);
+    join(b,     m, c, r, query, f);
+    join(m + 1, e, c, r, query, f);
+}
+
+// pairs between the point p, whose coordinates are already in query.point, and the points of the cell b
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+join(PointHandle p, const Cell& b, DistanceType r, Query& query, const F& f) const
+{
+    query.q     = p;
+    query.D     = r;
+    query.lower = b.lower;
+    query.upper = b.upper;
+
+    range(b.b, b.e, b.i, near_distance(query), query,
+          [&f,p](PointHandle q)                             { f(p,q); },
+          [&f,p](HCConstIterator b, HCConstIterator e)      { for (HCConstIterator it = b; it != e; ++it) f(p,*it); });
+}
+
+// brute force over two leaves (or over pairs within one leaf, if self)
+template<class T>
+template<class F>
+void
+nesoi::KDTree<T>::
+join_leaves(const Cell& a, const Cell& b, bool self, DistanceType r, Query& query, const F& f) const
+{
+    size_t na = a.e - a.b,
+           nb = b.e - b.b;
+
+    if (coordinates_.empty())
+    {
+        for (size_t j = 0; j < na; ++j)
+            for (size_t k = self ? j + 1 : 0; k < nb; ++k)
+                if (traits().distance(a.b[j], b.b[k]) <= r)
+                    f(a.b[j], b.b[k]);
+        return;
+    }
+
+    size_t              dim  = traits().dimension();
+    const Coordinate*   xa   = block(a.b);
+    const Coordinate*   xb   = block(b.b);
+    DistanceType*       dist = &query.distances[0];
+    for (size_t j = 0; j < na; ++j)
+    {
+        for (size_t c = 0; c < dim; ++c)
+            query.point[c] = xa[c*na + j];
+        simd::sq_distances(&query.point[0], xb, dim, nb, dist);
+
+        for (size_t k = self ? j + 1 : 0; k < nb; ++k)
+            if (std::sqrt(dist[k]) <= r)
+                f(a.b[j], b.b[k]);
+    }
+}
+
+template<class T>
+typename nesoi::KDTree<T>::HCConstIterator
+nesoi::KDTree<T>::
+split(const Cell& c, Cell& left, Cell& right) const
+{
+    HCConstIterator m     = c.b + (c.e - c.b)/2;
+    Coordinate      x     = coordinate(m, c.i);
+    size_t          i     = next_axis(c.i);
+
+    left  = Cell { c.b,   m,   i, c.lower, c.upper };
+    right = Cell { m + 1, c.e, i, c.lower, c.upper };
+    left.upper[c.i]  = x;
+    right.lower[c.i] = x;
+
+    return m;
+}
+
+template<class T>
+typename nesoi::KDTree<T>::DistanceType
+nesoi::KDTree<T>::
+near_distance(const Cell& a, const Cell& b) const
+{
+    DistanceType rd = 0;
+    for (size_t c = 0; c < traits().dimension(); ++c)
+    {
+        Coordinate x = std::max(std::max(a.lower[c] - b.upper[c], b.lower[c] - a.upper[c]), Coordinate(0));
+        rd += x*x;
+    }
+    return rd;
+}
+
+template<class T>
+bool
+nesoi::KDTree<T>::
+inside(const Cell& a, const Cell& b, DistanceType r) const
+{
+    // same as inside(query), but for the farthest pair of corners of the two cells
+    static constexpr DistanceType slack = 1 + 256*std::numeric_limits<DistanceType>::epsilon();
+    DistanceType D2 = r*r / slack;
+    DistanceType rD = 0;
+    for (size_t c = 0; c < traits().dimension(); ++c)
+    {
+        Coordinate x = std::max(a.upper[c] - b.lower[c], b.upper[c] - a.lower[c]);
+        rD += x*x;
+        if (!(rD < D2))
+            return false;
+    }
+    return true;
+}
+
+template<class T>
+bool
+nesoi::KDTree<T>::
+prune(DistanceType rd, DistanceType D)
+{
+    // rd is accumulated incrementally, so leave some slack for round-off;
+    // erring on the side of visiting a cell is always safe
+    static constexpr DistanceType slack = 1 + 256*std::numeric_limits<DistanceType>::epsilon();
+    return rd > D*D*slack;
+}
+
+template<class T>
+bool
+nesoi::KDTree<T>::
+inside(const Query& query) const
+{
+    // the mirror image of prune(): only take a cell wholesale if its farthest
+    // corner is inside the ball with room to spare; bail out early, since
+    // most cells are not inside
+    static constexpr DistanceType slack = 1 + 256*std::numeric_limits<DistanceType>::epsilon();
+    DistanceType D2 = query.D*query.D / slack;
+    DistanceType rD = 0;
+    for (size_t c = 0; c < traits().dimension(); ++c)
+    {
+        Coordinate x = far_offset(query, c);
+        rD += x*x;
+        if (!(rD < D2))
+            return false;
     }
+    return true;
 }
 
 template<class T>
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "parallel.h"
+
+namespace nesoi
+{
+
+// Sorts the handles along the Morton (Z-order) curve of the bounding box of
+// their points; with more than 64 axes, only the first 64 contribute to the code.
+// Points without coordinates all share one cell, so they keep their order.
+// Traits provides Coordinate, dimension(), coordinate(p,i) for PointHandle p.
+template<class Traits, class PointHandle>
+void morton_sort(const Traits& traits, std::vector<PointHandle>& handles)
+{
+    using Coordinate    = typename Traits::Coordinate;
+    using Code          = std::uint64_t;
+
+    size_t dim  = std::min<size_t>(traits.dimension(), 64);
+    if (handles.empty() || dim == 0)
+        return;
+
+    size_t bits = std::min<size_t>(64 / dim, 32);
+
+    std::vector<Coordinate> lower(dim), upper(dim);
+    for (size_t c = 0; c < dim; ++c)
+        lower[c] = upper[c] = traits.coordinate(handles[0], c);
+    for (PointHandle h : handles)
+        for (size_t c = 0; c < dim; ++c)
+        {
+            Coordinate x = traits.coordinate(h, c);
+            lower[c] = std::min(lower[c], x);
+            upper[c] = std::max(upper[c], x);
+        }
+
+    std::vector<std::pair<Code, PointHandle>> codes(handles.size());
+    nesoi::for_each(handles.size(), [&](size_t j)
+    {
+        PointHandle h = handles[j];
+
+        // quantize every axis to bits bits
+        Code cell[64];
+        Code max = (Code(1) << bits) - 1;
+        for (size_t c = 0; c < dim; ++c)
+        {
+            Coordinate extent = upper[c] - lower[c];
+            cell[c] = extent > 0 ? std::min(static_cast<Code>((traits.coordinate(h, c) - lower[c]) / extent * max), max) : 0;
+        }
+
+        // interleave, most significant bits first
+        Code code = 0;
+        for (size_t b = bits; b-- > 0; )
+            for (size_t c = 0; c < dim; ++c)
+                code = (code << 1) | ((cell[c] >> b) & 1);
+
+        codes[j] = std::make_pair(code, h);
+    });
+
+    std::stable_sort(codes.begin(), codes.end(),
+                     [](const std::pair<Code, PointHandle>& x, const std::pair<Code, PointHandle>& y) { return x.first < y.first; });
+    for (size_t j = 0; j < handles.size(); ++j)
+        handles[j] = codes[j].second;
+}
+
+}
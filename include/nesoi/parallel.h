@@ -1,14 +1,367 @@
 #pragma once
 
-#if !defined(NESOI_NO_PARALLEL)
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#if !defined(NESOI_NO_PARALLEL)
+#include <memory>
 #include <thread>
-#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <cstdint>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 #endif
 
 namespace nesoi
 {
 
+// Where parallel work runs. The context is global (see set_execution());
+// individual calls can still ask for fewer or more threads.
+struct Execution
+{
+    unsigned            threads     = 0;    // 0: one per available CPU (or per entry of cpus, if given)
+    std::vector<int>    cpus;               // pin the participants of a parallel call to these CPUs, round-robin: the calling
+                                            // thread (for the length of the call) to cpus[0], worker i to cpus[i % size];
+                                            // empty: no pinning
+    int                 numa_node   = -1;   // if >= 0, use (or restrict cpus to) the CPUs of this NUMA node; this only places
+                                            // the threads: memory is not bound to the node
+};
+
+inline const Execution& execution();
+inline void             set_execution(Execution e);
+
+// number of threads that a parallel call asking for threads (0 = the default) runs on
+inline unsigned         concurrency(unsigned threads = 0);
+
+// index of the calling thread among the participants of the parallel call it is working on, below
+// concurrency(threads) of that call (0 outside of one); for per-participant buffers
+inline unsigned         participant();
+
+namespace detail
+{
+
+inline Execution&       execution_context()         { static Execution e; return e; }
+
+// CPUs in the affinity mask of the process (respects taskset and cgroup cpusets)
+inline std::vector<int> available_cpus()
+{
+    std::vector<int> cpus;
+#if defined(__linux__) && !defined(NESOI_NO_PARALLEL)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+#endif
+    return cpus;
+}
+
+// parses /sys/devices/system/node/node<N>/cpulist, e.g., "0-3,8-11"
+inline std::vector<int> numa_cpus(int node)
+{
+    std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!in || !std::getline(in, list))
+        throw std::runtime_error("Cannot read the CPUs of NUMA node " + std::to_string(node));
+
+    std::vector<int> cpus;
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ','))
+    {
+        if (range.empty())
+            continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash)),
+            last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+#if !defined(NESOI_NO_PARALLEL)
+// Persistent pool of worker threads, started on first use and grown on
+// demand; the thread that submits a job takes part in it as participant 0.
+// The pool runs one job at a time: a job submitted while it is busy with
+// another thread's job runs on the submitting thread alone, rather than
+// waiting for the pool; so does a job submitted from inside a job.
+class ThreadPool
+{
+    public:
+        using Job = std::function<void(unsigned)>;         // called with the participant index
+
+        static ThreadPool&  instance()                      { static ThreadPool pool; return pool; }
+
+        // number of participants a job asking for threads (0 = the default) would get
+        unsigned            participants(unsigned threads) const
+        {
+            if (in_job())
+                return 1;
+            return concurrency(threads);
+        }
+
+        // index of the calling thread in the job it is running (see participant())
+        static unsigned     current()                       { return index(); }
+
+        // runs job(0), ..., job(participants - 1) concurrently and waits for all of them;
+        // rethrows the first exception thrown by any of them
+        void                run(unsigned participants, const Job& job)
+        {
+            std::unique_lock<std::mutex> submit(submit_, std::defer_lock);
+            if (participants <= 1 || !submit.try_lock())
+            {
+                // on the submitting thread, one participant after another
+                std::exception_ptr error;
+                for (unsigned i = 0; i < participants; ++i)
+                    execute(job, i, error);
+                if (error)
+                    std::rethrow_exception(error);
+                return;
+            }
+
+            grow(participants - 1);
+
+            // the submitting thread is participant 0, so it takes cpus_[0] (as worker i takes cpus_[i]) for the job
+#if defined(__linux__)
+            cpu_set_t caller;
+            bool repin = !cpus_.empty() && pthread_getaffinity_np(pthread_self(), sizeof(caller), &caller) == 0;
+            if (repin)
+                set_affinity(std::vector<int> { cpus_[0] });
+#endif
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                job_          = &job;
+                participants_ = participants;
+                running_      = participants - 1;
+                ++generation_;
+            }
+            start_.notify_all();
+
+            execute(job, 0, error_);
+
+            std::exception_ptr error;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_.wait(lock, [this]() { return running_ == 0; });
+                job_ = nullptr;
+                std::swap(error, error_);
+            }
+#if defined(__linux__)
+            if (repin)
+                pthread_setaffinity_np(pthread_self(), sizeof(caller), &caller);
+#endif
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        // the workers pick up the new CPUs when they start their next job
+        void                pin(const std::vector<int>& cpus)
+        {
+            std::lock_guard<std::mutex> submit(submit_);
+            std::lock_guard<std::mutex> lock(mutex_);
+            cpus_ = cpus;
+            ++affinity_;
+        }
+
+                            ThreadPool(const ThreadPool&)   = delete;
+        ThreadPool&         operator=(const ThreadPool&)    = delete;
+
+    private:
+                            ThreadPool():
+                                all_cpus_(available_cpus())             {}
+
+                            ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            start_.notify_all();
+            for (auto& worker : workers_)
+                worker.join();
+        }
+
+        // called with submit_ held, so generation_ cannot change under us
+        void                grow(unsigned workers)
+        {
+            while (workers_.size() < workers)
+            {
+                unsigned i    = workers_.size() + 1;
+                size_t   seen = generation_;
+                workers_.emplace_back([this,i,seen]() { work(i, seen); });
+            }
+        }
+
+        void                work(unsigned i, size_t seen)
+        {
+            size_t pinned = 0;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true)
+            {
+                start_.wait(lock, [this,seen]() { return stop_ || generation_ != seen; });
+                if (stop_)
+                    return;
+                seen = generation_;
+                if (i >= participants_)
+                    continue;
+
+                if (pinned != affinity_)
+                {
+                    set_affinity(cpus_.empty() ? all_cpus_ : std::vector<int> { cpus_[i % cpus_.size()] });
+                    pinned = affinity_;
+                }
+
+                const Job& job = *job_;
+                lock.unlock();
+                execute(job, i, error_);
+                lock.lock();
+
+                if (--running_ == 0)
+                    done_.notify_one();
+            }
+        }
+
+        static void         set_affinity(const std::vector<int>& cpus)
+        {
+#if defined(__linux__)
+            if (cpus.empty())
+                return;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus)
+                CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+            (void) cpus;
+#endif
+        }
+
+        // records the first exception in error, which mutex_ guards
+        void                execute(const Job& job, unsigned i, std::exception_ptr& error)
+        {
+            // a nested job runs on a single participant; the thread keeps its index in the outer job
+            bool nested = in_job();
+            if (!nested)
+                index() = i;
+            in_job() = true;
+            try
+            {
+                job(i);
+            } catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error)
+                    error = std::current_exception();
+            }
+            in_job() = nested;
+            if (!nested)
+                index() = 0;
+        }
+
+        static bool&        in_job()                        { static thread_local bool flag = false; return flag; }
+        static unsigned&    index()                         { static thread_local unsigned i = 0; return i; }
+
+    private:
+        std::vector<std::thread>    workers_;
+        std::vector<int>            all_cpus_;          // affinity of the process when the pool started
+        std::mutex                  submit_;            // held by the job on the pool (or by pin())
+        std::mutex                  mutex_;             // guards everything below
+        std::condition_variable     start_, done_;
+        const Job*                  job_            = nullptr;
+        unsigned                    participants_   = 0;
+        unsigned                    running_        = 0;
+        size_t                      generation_     = 0;
+        bool                        stop_           = false;
+        std::exception_ptr          error_;             // of the job on the pool
+        std::vector<int>            cpus_;
+        size_t                      affinity_       = 0;
+};
+#endif
+
+}
+
+const Execution&
+execution()
+{
+    return detail::execution_context();
+}
+
+// Not meant to be called while parallel work is running.
+void
+set_execution(Execution e)
+{
+    if (e.numa_node >= 0)
+    {
+        std::vector<int> node = detail::numa_cpus(e.numa_node);
+        if (e.cpus.empty())
+            e.cpus = node;
+        else
+        {
+            std::vector<int> cpus;
+            for (int cpu : e.cpus)
+                if (std::find(node.begin(), node.end(), cpu) != node.end())
+                    cpus.push_back(cpu);
+            if (cpus.empty())
+                throw std::runtime_error("None of the CPUs belong to NUMA node " + std::to_string(e.numa_node));
+            e.cpus = cpus;
+        }
+    }
+
+#if !defined(NESOI_NO_PARALLEL)
+    detail::ThreadPool::instance().pin(e.cpus);
+#endif
+    detail::execution_context() = e;
+}
+
+unsigned
+concurrency(unsigned threads)
+{
+#if defined(NESOI_NO_PARALLEL)
+    (void) threads;
+    return 1;
+#else
+    if (threads)
+        return threads;
+
+    const Execution& e = execution();
+    if (e.threads)
+        return e.threads;
+    if (!e.cpus.empty())
+        return e.cpus.size();
+
+    static const unsigned available = []()
+    {
+        size_t cpus = detail::available_cpus().size();
+        return static_cast<unsigned>(cpus ? cpus : std::max(1u, std::thread::hardware_concurrency()));
+    }();
+    return available;
+#endif
+}
+
+unsigned
+participant()
+{
+#if defined(NESOI_NO_PARALLEL)
+    return 0;
+#else
+    return detail::ThreadPool::current();
+#endif
+}
+
+// Calls f(u) for u = 0, ..., n-1 on the persistent pool. Every participant
+// starts with a contiguous share of the range and takes it in small chunks;
+// once its share runs out, it steals the back half of another participant's.
 template<class T, class F>
 void for_each(T n, const F& f, unsigned threads = 0)
 {
@@ -16,24 +369,106 @@ void for_each(T n, const F& f, unsigned threads = 0)
     for (T u = 0; u < n; ++u)
         f(u);
 #else
-    if (!threads)
-        threads = std::thread::hardware_concurrency();
-    std::vector<std::future<void>> handles;
-    for (unsigned i = 0; i < threads; ++i)
-    {
-        handles.emplace_back(std::async(std::launch::async,
-                                        [i,threads,n,&f]()
-                                        {
-                                            size_t chunk = n / threads;
-                                            T b = chunk*i,
-                                              e = (i == threads - 1 ? n : chunk*(i+1));
-                                            for (T u = b; u < e; ++u)
-                                                f(u);
-                                        }));
+    detail::ThreadPool& pool = detail::ThreadPool::instance();
+
+    unsigned participants = pool.participants(threads);
+    if (participants == 1 || n <= 1)
+    {
+        for (T u = 0; u < n; ++u)
+            f(u);
+        return;
     }
 
-    // handles' destructors make sure that everything runs
+    struct Range
+    {
+        std::mutex  mutex;
+        T           b, e;
+    };
+    std::unique_ptr<Range[]> ranges(new Range[participants]);
+    for (unsigned i = 0; i < participants; ++i)
+    {
+        ranges[i].b = static_cast<T>(static_cast<std::uintmax_t>(n) * i       / participants);
+        ranges[i].e = static_cast<T>(static_cast<std::uintmax_t>(n) * (i + 1) / participants);
+    }
+    T grain = std::max(T(1), static_cast<T>(n / (64 * participants)));
+
+    // next chunk from the front of one's own range
+    auto take = [grain](Range& r, T& b, T& e)
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (r.b == r.e)
+            return false;
+        b = r.b;
+        e = (r.e - r.b > grain) ? r.b + grain : r.e;
+        r.b = e;
+        return true;
+    };
+
+    // back half of the victim's range
+    auto steal = [](Range& victim, Range& mine)
+    {
+        T b, e;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.b == victim.e)
+                return false;
+            b = victim.b + (victim.e - victim.b)/2;
+            e = victim.e;
+            victim.e = b;
+        }
+        std::lock_guard<std::mutex> lock(mine.mutex);
+        mine.b = b;
+        mine.e = e;
+        return true;
+    };
+
+    pool.run(participants, [&](unsigned i)
+    {
+        Range& mine = ranges[i];
+        T b, e;
+        while (true)
+        {
+            while (take(mine, b, e))
+                for (T u = b; u < e; ++u)
+                    f(u);
+
+            bool stolen = false;
+            for (unsigned k = 1; k < participants && !stolen; ++k)
+                stolen = steal(ranges[(i + k) % participants], mine);
+            if (!stolen)
+                break;
+        }
+    });
 #endif
 }
 
+// Sorts [b,e) with cmp: the pieces of the range are sorted in parallel, and then merged pairwise, also in parallel.
+template<class Iterator, class Compare>
+void parallel_sort(Iterator b, Iterator e, const Compare& cmp, unsigned threads = 0)
+{
+    size_t   n      = e - b;
+    unsigned pieces = concurrency(threads);
+    if (pieces == 1 || n < 16384)
+    {
+        std::sort(b, e, cmp);
+        return;
+    }
+
+    std::vector<size_t> bounds(pieces + 1);
+    for (unsigned i = 0; i <= pieces; ++i)
+        bounds[i] = n * i / pieces;
+
+    for_each(pieces, [&](unsigned i) { std::sort(b + bounds[i], b + bounds[i+1], cmp); }, pieces);
+
+    for (unsigned width = 1; width < pieces; width *= 2)
+        for_each((pieces + 2*width - 1) / (2*width), [&](unsigned j)
+        {
+            unsigned lo  = 2*width*j,
+                     mid = std::min(lo + width, pieces),
+                     hi  = std::min(lo + 2*width, pieces);
+            if (mid < hi)
+                std::inplace_merge(b + bounds[lo], b + bounds[mid], b + bounds[hi], cmp);
+        }, pieces);
+}
+
 }
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__)) && !defined(NESOI_NO_SIMD)
+#define NESOI_SIMD_X86
+#include <immintrin.h>
+#define NESOI_TARGET(isa)   __attribute__((target(isa)))
+#endif
+
+// Squared Euclidean distance kernels, vectorized with SSE2, AVX2+FMA, or AVX-512,
+// selected at runtime. The one-vs-many kernel, sq_distances(), takes the points
+// in a structure-of-arrays block (axis c of point j at block[c*n + j], or at
+// block[c*stride + j] for n points out of a larger block).
+
+namespace nesoi
+{
+namespace simd
+{
+
+enum class Isa { scalar, sse2, avx2, avx512 };
+
+inline Isa      isa();                      // instruction set currently in use
+inline Isa      detected_isa();             // best instruction set supported by the CPU
+inline void     set_isa(Isa isa);           // restrict dispatch (clamped to detected_isa())
+
+template<class T>
+T               sq_distance(const T* x, const T* y, size_t dim);
+
+template<class C, class D>
+void            sq_distances(const C* q, const C* block, size_t dim, size_t n, D* out);
+template<class C, class D>
+void            sq_distances(const C* q, const C* block, size_t stride, size_t dim, size_t n, D* out);
+
+inline float    sq_distance(const float* x, const float* y, size_t dim);
+inline double   sq_distance(const double* x, const double* y, size_t dim);
+
+inline void     sq_distances(const float* q, const float* block, size_t dim, size_t n, float* out);
+inline void     sq_distances(const double* q, const double* block, size_t dim, size_t n, double* out);
+inline void     sq_distances(const float* q, const float* block, size_t stride, size_t dim, size_t n, float* out);
+inline void     sq_distances(const double* q, const double* block, size_t stride, size_t dim, size_t n, double* out);
+
+}
+}
+
+#include "simd.hpp"
@@ -0,0 +1,426 @@
+namespace nesoi
+{
+namespace simd
+{
+namespace detail
+{
+
+// set_isa() may run while other threads are in the kernels; relaxed is enough, any of the ISAs gives a valid result
+inline std::atomic<Isa>& current_isa()      { static std::atomic<Isa> isa { detected_isa() }; return isa; }
+
+template<class T>
+T sq_distance_scalar(const T* x, const T* y, size_t dim)
+{
+    T sq_dist = 0;
+    for (size_t i = 0; i < dim; ++i)
+    {
+        T d = x[i] - y[i];
+        sq_dist += d*d;
+    }
+    return sq_dist;
+}
+
+template<class C, class D>
+void sq_distances_scalar(const C* q, const C* block, size_t stride, size_t dim, size_t n, D* out)
+{
+    for (size_t j = 0; j < n; ++j)
+        out[j] = 0;
+    for (size_t c = 0; c < dim; ++c)
+    {
+        const C* x  = block + c*stride;
+        C        qc = q[c];
+        for (size_t j = 0; j < n; ++j)
+        {
+            D d = qc - x[j];
+            out[j] += d*d;
+        }
+    }
+}
+
+#if defined(NESOI_SIMD_X86)
+
+NESOI_TARGET("sse2")
+inline float hsum(__m128 v)
+{
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+NESOI_TARGET("sse2")
+inline double hsum(__m128d v)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+NESOI_TARGET("avx2,fma")
+inline float hsum(__m256 v)
+{
+    return hsum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+NESOI_TARGET("avx2,fma")
+inline double hsum(__m256d v)
+{
+    return hsum(_mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)));
+}
+
+// by hand, with the zero-masked extracts: _mm512_reduce_add_* and the plain extracts and casts start from
+// an undefined vector, which GCC flags as uninitialized; the floats are extracted as doubles, so that
+// AVX-512F suffices (_mm512_extractf32x8_ps needs AVX-512DQ)
+NESOI_TARGET("avx512f")
+inline double hsum(__m512d v)
+{
+    return hsum(_mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xFF, v, 0), _mm512_maskz_extractf64x4_pd(0xFF, v, 1)));
+}
+
+NESOI_TARGET("avx512f")
+inline float hsum(__m512 v)
+{
+    __m512d w = _mm512_castps_pd(v);
+    return hsum(_mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, w, 0)),
+                              _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xFF, w, 1))));
+}
+
+// sq_distance: one pair of points, vectorized over the coordinates
+
+NESOI_TARGET("sse2")
+inline float sq_distance_sse2(const float* x, const float* y, size_t dim)
+{
+    __m128 acc = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= dim; i += 4)
+    {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+        acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+    }
+    return hsum(acc) + sq_distance_scalar(x + i, y + i, dim - i);
+}
+
+NESOI_TARGET("sse2")
+inline double sq_distance_sse2(const double* x, const double* y, size_t dim)
+{
+    __m128d acc = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 2 <= dim; i += 2)
+    {
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+        acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+    }
+    return hsum(acc) + sq_distance_scalar(x + i, y + i, dim - i);
+}
+
+NESOI_TARGET("avx2,fma")
+inline float sq_distance_avx2(const float* x, const float* y, size_t dim)
+{
+    __m256 acc = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8)
+    {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    return hsum(acc) + sq_distance_sse2(x + i, y + i, dim - i);
+}
+
+NESOI_TARGET("avx2,fma")
+inline double sq_distance_avx2(const double* x, const double* y, size_t dim)
+{
+    __m256d acc = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= dim; i += 4)
+    {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+        acc = _mm256_fmadd_pd(d, d, acc);
+    }
+    return hsum(acc) + sq_distance_sse2(x + i, y + i, dim - i);
+}
+
+NESOI_TARGET("avx512f")
+inline float sq_distance_avx512(const float* x, const float* y, size_t dim)
+{
+    __m512 acc = _mm512_setzero_ps();
+    for (size_t i = 0; i < dim; i += 16)
+    {
+        __mmask16 m = (dim - i >= 16) ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (dim - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return hsum(acc);
+}
+
+NESOI_TARGET("avx512f")
+inline double sq_distance_avx512(const double* x, const double* y, size_t dim)
+{
+    __m512d acc = _mm512_setzero_pd();
+    for (size_t i = 0; i < dim; i += 8)
+    {
+        __mmask8 m = (dim - i >= 8) ? static_cast<__mmask8>(0xFF) : static_cast<__mmask8>((1u << (dim - i)) - 1);
+        __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(m, x + i), _mm512_maskz_loadu_pd(m, y + i));
+        acc = _mm512_fmadd_pd(d, d, acc);
+    }
+    return hsum(acc);
+}
+
+// sq_distances: one query against a structure-of-arrays block, vectorized over the points
+
+NESOI_TARGET("sse2")
+inline void sq_distances_sse2(const float* q, const float* block, size_t stride, size_t dim, size_t n, float* out)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128 acc = _mm_setzero_ps();
+        for (size_t c = 0; c < dim; ++c)
+        {
+            __m128 d = _mm_sub_ps(_mm_set1_ps(q[c]), _mm_loadu_ps(block + c*stride + j));
+            acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+        }
+        _mm_storeu_ps(out + j, acc);
+    }
+    for (; j < n; ++j)
+    {
+        float acc = 0;
+        for (size_t c = 0; c < dim; ++c)
+        {
+            float d = q[c] - block[c*stride + j];
+            acc += d*d;
+        }
+        out[j] = acc;
+    }
+}
+
+NESOI_TARGET("sse2")
+inline void sq_distances_sse2(const double* q, const double* block, size_t stride, size_t dim, size_t n, double* out)
+{
+    size_t j = 0;
+    for (; j + 2 <= n; j += 2)
+    {
+        __m128d acc = _mm_setzero_pd();
+        for (size_t c = 0; c < dim; ++c)
+        {
+            __m128d d = _mm_sub_pd(_mm_set1_pd(q[c]), _mm_loadu_pd(block + c*stride + j));
+            acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+        }
+        _mm_storeu_pd(out + j, acc);
+    }
+    for (; j < n; ++j)
+    {
+        double acc = 0;
+        for (size_t c = 0; c < dim; ++c)
+        {
+            double d = q[c] - block[c*stride + j];
+            acc += d*d;
+        }
+        out[j] = acc;
+    }
+}
+
+NESOI_TARGET("avx2,fma")
+inline void sq_distances_avx2(const float* q, const float* block, size_t stride, size_t dim, size_t n, float* out)
+{
+    size_t j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t c = 0; c < dim; ++c)
+        {
+            __m256 d = _mm256_sub_ps(_mm256_set1_ps(q[c]), _mm256_loadu_ps(block + c*stride + j));
+            acc = _mm256_fmadd_ps(d, d, acc);
+        }
+        _mm256_storeu_ps(out + j, acc);
+    }
+    for (; j < n; ++j)
+    {
+        float acc = 0;
+        for (size_t c = 0; c < dim; ++c)
+        {
+            float d = q[c] - block[c*stride + j];
+            acc = std::fma(d, d, acc);      // rounded as in the vector lanes
+        }
+        out[j] = acc;
+    }
+}
+
+NESOI_TARGET("avx2,fma")
+inline void sq_distances_avx2(const double* q, const double* block, size_t stride, size_t dim, size_t n, double* out)
+{
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m256d acc = _mm256_setzero_pd();
+        for (size_t c = 0; c < dim; ++c)
+        {
+            __m256d d = _mm256_sub_pd(_mm256_set1_pd(q[c]), _mm256_loadu_pd(block + c*stride + j));
+            acc = _mm256_fmadd_pd(d, d, acc);
+        }
+        _mm256_storeu_pd(out + j, acc);
+    }
+    for (; j < n; ++j)
+    {
+        double acc = 0;
+        for (size_t c = 0; c < dim; ++c)
+        {
+            double d = q[c] - block[c*stride + j];
+            acc = std::fma(d, d, acc);
+        }
+        out[j] = acc;
+    }
+}
+
+NESOI_TARGET("avx512f")
+inline void sq_distances_avx512(const float* q, const float* block, size_t stride, size_t dim, size_t n, float* out)
+{
+    for (size_t j = 0; j < n; j += 16)
+    {
+        __mmask16 m = (n - j >= 16) ? static_cast<__mmask16>(0xFFFF) : static_cast<__mmask16>((1u << (n - j)) - 1);
+        __m512 acc = _mm512_setzero_ps();
+        for (size_t c = 0; c < dim; ++c)
+        {
+            __m512 d = _mm512_sub_ps(_mm512_set1_ps(q[c]), _mm512_maskz_loadu_ps(m, block + c*stride + j));
+            acc = _mm512_fmadd_ps(d, d, acc);
+        }
+        _mm512_mask_storeu_ps(out + j, m, acc);
+    }
+}
+
+NESOI_TARGET("avx512f")
+inline void sq_distances_avx512(const double* q, const double* block, size_t stride, size_t dim, size_t n, double* out)
+{
+    for (size_t j = 0; j < n; j += 8)
+    {
+        __mmask8 m = (n - j >= 8) ? static_cast<__mmask8>(0xFF) : static_cast<__mmask8>((1u << (n - j)) - 1);
+        __m512d acc = _mm512_setzero_pd();
+        for (size_t c = 0; c < dim; ++c)
+        {
+            __m512d d = _mm512_sub_pd(_mm512_set1_pd(q[c]), _mm512_maskz_loadu_pd(m, block + c*stride + j));
+            acc = _mm512_fmadd_pd(d, d, acc);
+        }
+        _mm512_mask_storeu_pd(out + j, m, acc);
+    }
+}
+
+#endif
+
+template<class T>
+T sq_distance(const T* x, const T* y, size_t dim)
+{
+#if defined(NESOI_SIMD_X86)
+    switch (current_isa().load(std::memory_order_relaxed))
+    {
+        case Isa::avx512:   return sq_distance_avx512(x, y, dim);
+        case Isa::avx2:     return sq_distance_avx2(x, y, dim);
+        case Isa::sse2:     return sq_distance_sse2(x, y, dim);
+        default:            break;
+    }
+#endif
+    return sq_distance_scalar(x, y, dim);
+}
+
+template<class T>
+void sq_distances(const T* q, const T* block, size_t stride, size_t dim, size_t n, T* out)
+{
+#if defined(NESOI_SIMD_X86)
+    switch (current_isa().load(std::memory_order_relaxed))
+    {
+        case Isa::avx512:   sq_distances_avx512(q, block, stride, dim, n, out); return;
+        case Isa::avx2:     sq_distances_avx2(q, block, stride, dim, n, out);   return;
+        case Isa::sse2:     sq_distances_sse2(q, block, stride, dim, n, out);   return;
+        default:            break;
+    }
+#endif
+    sq_distances_scalar(q, block, stride, dim, n, out);
+}
+
+}
+
+inline Isa
+detected_isa()
+{
+#if defined(NESOI_SIMD_X86)
+    static Isa detected = []()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return Isa::avx512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return Isa::avx2;
+        return Isa::sse2;
+    }();
+    return detected;
+#else
+    return Isa::scalar;
+#endif
+}
+
+inline Isa
+isa()
+{
+    return detail::current_isa().load(std::memory_order_relaxed);
+}
+
+inline void
+set_isa(Isa isa)
+{
+    detail::current_isa().store(isa < detected_isa() ? isa : detected_isa(), std::memory_order_relaxed);
+}
+
+template<class T>
+T
+sq_distance(const T* x, const T* y, size_t dim)
+{
+    return detail::sq_distance_scalar(x, y, dim);
+}
+
+template<class C, class D>
+void
+sq_distances(const C* q, const C* block, size_t dim, size_t n, D* out)
+{
+    detail::sq_distances_scalar(q, block, n, dim, n, out);
+}
+
+template<class C, class D>
+void
+sq_distances(const C* q, const C* block, size_t stride, size_t dim, size_t n, D* out)
+{
+    detail::sq_distances_scalar(q, block, stride, dim, n, out);
+}
+
+inline float
+sq_distance(const float* x, const float* y, size_t dim)
+{
+    return detail::sq_distance(x, y, dim);
+}
+
+inline double
+sq_distance(const double* x, const double* y, size_t dim)
+{
+    return detail::sq_distance(x, y, dim);
+}
+
+inline void
+sq_distances(const float* q, const float* block, size_t dim, size_t n, float* out)
+{
+    detail::sq_distances(q, block, n, dim, n, out);
+}
+
+inline void
+sq_distances(const float* q, const float* block, size_t stride, size_t dim, size_t n, float* out)
+{
+    detail::sq_distances(q, block, stride, dim, n, out);
+}
+
+inline void
+sq_distances(const double* q, const double* block, size_t dim, size_t n, double* out)
+{
+    detail::sq_distances(q, block, n, dim, n, out);
+}
+
+inline void
+sq_distances(const double* q, const double* block, size_t stride, size_t dim, size_t n, double* out)
+{
+    detail::sq_distances(q, block, stride, dim, n, out);
+}
+
+}
+}
@@ -2,14 +2,40 @@
 
 #include <vector>
 #include <utility>
+#include <tuple>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
 #if !defined(NESOI_NO_PARALLEL)
 #include <atomic>
 #endif
+#if defined(NESOI_TMT_STATS)
+#include <memory>
+#endif
+
+#include "grid.h"
 
 namespace nesoi
 {
 
+// Non-owning view of size edges stored contiguously as (u0, v0, u1, v1, ...)
+template<class Index>
+class EdgeArray
+{
+    public:
+        using Edge  = std::pair<Index, Index>;
+
+                    EdgeArray(const Index* edges, size_t size):
+                        edges_(edges), size_(size)          {}
+
+        size_t      size() const                            { return size_; }
+        Edge        operator[](size_t i) const              { return Edge { edges_[2*i], edges_[2*i + 1] }; }
+
+    private:
+        const Index*    edges_;
+        size_t          size_;
+};
+
 template<class Value_, class Vertex_ = std::uint32_t>
 class TripletMergeTree
 {
@@ -28,8 +54,10 @@ class TripletMergeTree
 
 #if !defined(NESOI_NO_PARALLEL)
         using AtomicEdge   = std::atomic<Edge>;
+        using AtomicIndex  = std::atomic<int64_t>;
 #else
         using AtomicEdge   = Edge;
+        using AtomicIndex  = int64_t;
 #endif
 
         using Function     = std::vector<Value>;
@@ -68,12 +96,17 @@ class TripletMergeTree
 #endif
 
 
-        Edge        repair(Vertex u);
+        Edge        repair(Vertex u)                        { return repair(u, ValueOrder { this }); }
         void        repair();
 
-        void        merge(Vertex u, Vertex v);
-        void        merge(Vertex u, Vertex s, Vertex v);
-        Vertex      representative(Vertex u, Vertex a) const;
+        void        merge(Vertex u, Vertex v)               { merge(u, v, ValueOrder { this }); }
+        void        merge(Vertex u, Vertex s, Vertex v)     { merge(u, s, v, ValueOrder { this }); }
+        Vertex      representative(Vertex u, Vertex a) const    { return representative(u, a, ValueOrder { this }); }
+
+        // merges the edges that each_edge(f) reports, as f(u,v) calls from any number of threads, and repairs the tree;
+        // every vertex must have been added
+        template<class EachEdge>
+        void        merge_edges(const EachEdge& each_edge);
 
         size_t      size() const                            { return tree_.size(); }
         bool        contains(const Vertex& u) const         { return (*this)[u] != dummy(); }
@@ -81,33 +114,103 @@ class TripletMergeTree
         bool        negate() const                          { return negate_; }
         void        set_negate(bool negate)                 { negate_ = negate; }
 
+        unsigned    threads() const                         { return threads_; }
+        void        set_threads(unsigned threads)           { threads_ = threads; }     // 0 = the default of the execution context (see parallel.h)
+
+        // with shortcuts, merge() and repair() point the triplets they walk past further up the tree, when the
+        // through-vertex of the next triplet comes no later in the filtration (!cmp(s,t)), with a CAS that keeps
+        // the through-vertex (as repair() does)
+        bool        shortcut() const                        { return shortcut_; }
+        void        set_shortcut(bool shortcut)             { shortcut_ = shortcut; }
+
+        // with presort, merge_edges() (and so compute_mt()) relabels the vertices by their rank in the order of cmp(),
+        // builds the tree over the ranks, where the comparisons are integer comparisons and the walks stay in nearby
+        // memory, and maps the tree back to the vertices; the result is the same
+        bool        presort() const                         { return presort_; }
+        void        set_presort(bool presort)               { presort_ = presort; }
+
+#if defined(NESOI_TMT_STATS)
+        // walks up the tree (in representative() and with shortcuts), the triplets they passed, and the shortcuts taken;
+        // steps / walks is the average chain length
+        struct Stats
+        {
+            int64_t     walks, steps, shortcuts;
+        };
+        Stats       stats() const                           { return Stats { stats_->walks, stats_->steps, stats_->shortcuts }; }
+        void        reset_stats()                           { stats_->walks = 0; stats_->steps = 0; stats_->shortcuts = 0; }
+#endif
+
         template<class F>
         void        traverse_persistence(const F& f) const;
 
+        // intervals of the pairs reported by traverse_persistence(), without the zero-persistence ones:
+        // birth is the value of u, death the value of s (0 for the essential vertices, whose persistence is their value);
+        // optionally sorted by decreasing (persistence, birth, death, value of v, u), i.e., as plot.py used to
+        struct Intervals
+        {
+            Function    births, deaths, persistence;
+            IndexArray  vertices;
+        };
+        Intervals   persistence_intervals(bool sort = true, Value min_persistence = std::numeric_limits<Value>::lowest()) const;
+
         Edge        dummy() const                           { return Edge { static_cast<Vertex>(-1), static_cast<Vertex>(-1)}; }
         Edge        operator[](Vertex u) const              { return tree_[u]; }
         Value       value(Vertex u) const                   { return function_[u]; }
 
+        // clusters at threshold k: -1 for the vertices with value < k; for the rest, the representative of their
+        // component of the superlevel set, i.e., the end of the path along the edges whose through- and to-vertices have
+        // value >= k; on a superlevel tree (negate) the to-vertex never has a lower value than the through-vertex, but on
+        // a sublevel tree it may: the path then stops before it, so no cluster contains (or is joined through) a vertex
+        // below k; sizes, if given, receives the size of every cluster, indexed by its representative
+        std::vector<int64_t>    cluster_labels(Value k, std::vector<int64_t>* sizes = nullptr) const;
+
+        // clusters at all the thresholds (sorted, in either direction), in one pass that adds the vertices and the edges
+        // of the tree in the order of their values, since the superlevel sets are nested: row t of the count x size() matrix
+        // is cluster_labels(thresholds[t])
+        std::vector<int64_t>    cluster_labels(const Value* thresholds, size_t count) const;
+
+        // same as a compact hierarchy: at threshold[t], the cluster labeled from is labeled to from then on
+        // (from == to: vertex from enters as a new cluster); the events are listed in the order of the sweep
+        struct ClusterEvents
+        {
+            std::vector<size_t> threshold;
+            IndexArray          from, to;
+        };
+        ClusterEvents           cluster_events(const Value* thresholds, size_t count) const;
+
         template<class F>
         void        for_each_vertex(const F& f) const       { for_each_vertex(size(), f); }
 
         template<class F>
         void        for_each_vertex(Vertex n, const F& f) const;
 
-        void        compute_mt(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const values, bool negate);
+        // Edges is any random-access container of (u,v) pairs that supports size() and std::get<0>/<1> on its elements,
+        // e.g., std::vector<std::tuple<Vertex,Vertex>> or EdgeArray
+
+        // adds all the vertices and merges the edges in parallel (serially, and so deterministically step by step, with set_threads(1))
+        template<class Edges>
+        void        compute_mt(const Edges& edges, const int64_t* const labels, const Value* const values, bool negate);
+
+        // same on the implicit graph of a grid (values in its row-major order), so every method below also takes a Grid for edges
+        void        compute_mt(const Grid& grid, const int64_t* const labels, const Value* const values, bool negate);
 
-        Function    simplify(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const values, Value epsilon, bool negate, bool squash_root);
-        Function    simplify(const std::vector<std::tuple<Vertex,Vertex>>& edges, const Value* const values, Value epsilon, Value level_value, bool negate);
+        template<class Edges>
+        Function    simplify(const Edges& edges, const int64_t* const labels, const Value* const values, Value epsilon, bool negate, bool squash_root);
+        template<class Edges>
+        Function    simplify(const Edges& edges, const Value* const values, Value epsilon, Value level_value, bool negate);
 
-        Diagram     diagram(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const values, bool negate, bool squash_root);
+        template<class Edges>
+        Diagram     diagram(const Edges& edges, const int64_t* const labels, const Value* const values, bool negate, bool squash_root);
 
-        size_t      n_components(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels);
+        template<class Edges>
+        size_t      n_components(const Edges& edges, const int64_t* const labels);
 
         // return quadruple: noisy pairs (persistence < epsilon),
         //                   non-noisy pairs (persistence >= epsilon),
         //                   noisy essential simplices (if squash root: birth < epsilon, otherwise empty),
         //                   non-noisy essential simplices (if squash root: birth >= epsilon, otherwise all essential simplices)
-        Pairings    pairings(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const values, bool negate, bool squash_root, Value epsilon);
+        template<class Edges>
+        Pairings    pairings(const Edges& edges, const int64_t* const labels, const Value* const values, bool negate, bool squash_root, Value epsilon);
 
     private:
 
@@ -127,6 +230,71 @@ class TripletMergeTree
 #endif
         }
 
+        bool        interval(Vertex u, Value& birth, Value& death, Value& persistence) const;
+
+        // orders of the vertices in the walks: by cmp(), or, over the ranks of presort, by index
+        struct ValueOrder
+        {
+            const TripletMergeTree*     tree;
+            bool    operator()(Vertex u, Vertex v) const    { return tree->cmp(u, v); }
+        };
+        struct RankOrder
+        {
+            bool    operator()(Vertex u, Vertex v) const    { return u < v; }
+        };
+
+        template<class Order>
+        Edge        repair(Vertex u, const Order& cmp);
+        template<class Order>
+        void        merge(Vertex u, Vertex v, const Order& cmp);
+        template<class Order>
+        void        merge(Vertex u, Vertex s, Vertex v, const Order& cmp);
+        template<class Order>
+        Vertex      representative(Vertex u, Vertex a, const Order& cmp) const;
+        template<class Order>
+        Vertex      representative_shortcut(Vertex u, Vertex a, const Order& cmp);
+        template<class Order>
+        Vertex      walk(Vertex u, Vertex a, const Order& cmp)  { return shortcut_ ? representative_shortcut(u, a, cmp) : representative(u, a, cmp); }
+
+        // each_edge for merge_edges(): the edges of compute_mt(), with the same labels at both ends, if any
+        template<class Edges>
+        struct EdgeList
+        {
+            const Edges&        edges;
+            const int64_t*      labels;
+            unsigned            threads;
+
+            template<class F>
+            void    operator()(const F& f) const
+            {
+                for_each(edges.size(), [this,&f](size_t i)
+                {
+                    Vertex u = std::get<0>(edges[i]), v = std::get<1>(edges[i]);
+                    if (!labels || labels[u] == labels[v])
+                        f(u, v);
+                }, threads);
+            }
+        };
+        struct GridEdges
+        {
+            const Grid&         grid;
+            const int64_t*      labels;
+            unsigned            threads;
+
+            template<class F>
+            void    operator()(const F& f) const
+            {
+                grid.for_each_edge([this,&f](size_t u, size_t v)
+                {
+                    if (!labels || labels[u] == labels[v])
+                        f(u, v);
+                }, threads);
+            }
+        };
+
+        // fills the labels (count x size()) and/or the events of the thresholds, whichever is given
+        void        sweep_clusters(const Value* thresholds, size_t count, std::vector<int64_t>* labels, ClusterEvents* events) const;
+
         void        cache_all_reps(Value epsilon, bool squash_root);
         void        cache_all_reps(Value epsilon, Value level_value);
         Vertex      simplification_repr(Vertex u, Value epsilon, bool squash_root);
@@ -136,9 +304,20 @@ class TripletMergeTree
 
     private:
         bool        negate_;
+        unsigned    threads_ = 0;
+        bool        shortcut_ = false;
+        bool        presort_ = false;
         Function    function_;
         IndexArray  cache_;
         Tree        tree_;
+
+#if defined(NESOI_TMT_STATS)
+        struct Counters
+        {
+            AtomicIndex walks {0}, steps {0}, shortcuts {0};
+        };
+        std::unique_ptr<Counters>   stats_ { new Counters };     // behind a pointer, so that the tree stays movable
+#endif
 };
 
 }
@@ -1,4 +1,7 @@
 #include <iostream>     // for std::cerr
+#include <cmath>
+#include <algorithm>
+#include <functional>
 #include "parallel.h"
 
 template<class Value, class Vertex>
@@ -24,10 +27,14 @@ add(Vertex x, Value v)
 }
 
 template<class Value, class Vertex>
+template<class Order>
 typename nesoi::TripletMergeTree<Value, Vertex>::Vertex
 nesoi::TripletMergeTree<Value, Vertex>::
-representative(Vertex u, Vertex a) const
+representative(Vertex u, Vertex a, const Order& cmp) const
 {
+#if defined(NESOI_TMT_STATS)
+    int64_t steps = 0;
+#endif
     Edge sv = tree_[u];
     Vertex s = sv.through;
     Vertex v = sv.to;
@@ -37,14 +44,60 @@ representative(Vertex u, Vertex a) const
         sv = tree_[u];
         s  = sv.through;
         v  = sv.to;
+#if defined(NESOI_TMT_STATS)
+        ++steps;
+#endif
     }
+#if defined(NESOI_TMT_STATS)
+    stats_->walks += 1;
+    stats_->steps += steps;
+#endif
     return u;
 }
 
+// Same walk; whenever the triplet (v,t,w) after (u,s,v) has t no later than s in the filtration, i.e., !cmp(s,t),
+// v is already joined to w when u joins v at s, so (u,s,w) is also a valid triplet: u is pointed at w directly,
+// and the walk skips v (path halving). Shortcutting when t comes after s would join u to w too early.
 template<class Value, class Vertex>
+template<class Order>
+typename nesoi::TripletMergeTree<Value, Vertex>::Vertex
+nesoi::TripletMergeTree<Value, Vertex>::
+representative_shortcut(Vertex u, Vertex a, const Order& cmp)
+{
+#if defined(NESOI_TMT_STATS)
+    int64_t steps = 0, shortcuts = 0;
+#endif
+    Edge sv = tree_[u];
+    while (!cmp(a, sv.through) && sv.through != sv.to)
+    {
+        Vertex v  = sv.to;
+        Edge   tw = tree_[v];
+        if (tw.through != tw.to && !cmp(sv.through, tw.through) && cas_link(u, sv.through, v, sv.through, tw.to))
+        {
+            u = tw.to;
+#if defined(NESOI_TMT_STATS)
+            ++shortcuts;
+#endif
+        } else
+            u = v;
+        sv = tree_[u];
+#if defined(NESOI_TMT_STATS)
+        ++steps;
+#endif
+    }
+#if defined(NESOI_TMT_STATS)
+    stats_->walks     += 1;
+    stats_->steps     += steps;
+    stats_->shortcuts += shortcuts;
+#endif
+    return u;
+}
+
+template<class Value, class Vertex>
+template<class Order>
 typename nesoi::TripletMergeTree<Value, Vertex>::Edge
 nesoi::TripletMergeTree<Value, Vertex>::
-repair(Vertex u)
+repair(Vertex u, const Order& cmp)
 {
     Vertex s, v, ov;
     do
@@ -52,7 +105,7 @@ repair(Vertex u)
         Edge sov = tree_[u];
         s  = sov.through;
         ov = sov.to;
-        v = representative(u, s);
+        v = walk(u, s, cmp);
         if (u == v) return Edge {s,v};
     } while (!cas_link(u,s,ov,s,v));
 
@@ -67,35 +120,72 @@ repair()
     for_each_vertex([&](Vertex u) { repair(u); });
 }
 
+template<class Value, class Vertex>
+template<class EachEdge>
+void
+nesoi::TripletMergeTree<Value, Vertex>::
+merge_edges(const EachEdge& each_edge)
+{
+    // merge is lock-free, so the edges are merged in parallel; the result does not depend on the order
+    if (!presort_)
+    {
+        ValueOrder order { this };
+        each_edge([this,&order](Vertex u, Vertex v) { merge(u, v, order); });
+        for_each_vertex([this,&order](Vertex u) { repair(u, order); });
+        return;
+    }
+
+    // vertices[r] has rank r
+    IndexArray vertices(size()), rank(size());
+    for_each_vertex([&vertices](Vertex u) { vertices[u] = u; });
+    parallel_sort(vertices.begin(), vertices.end(), ValueOrder { this }, threads_);
+    for_each_vertex([&vertices,&rank](Vertex r) { rank[vertices[r]] = r; });
+
+    RankOrder order;
+    for_each_vertex([this](Vertex r) { link(r, r, r); });
+    each_edge([this,&rank,&order](Vertex u, Vertex v) { merge(rank[u], rank[v], order); });
+    for_each_vertex([this,&order](Vertex r) { repair(r, order); });
+
+    Tree tree(size());
+    for_each_vertex([this,&vertices,&tree](Vertex r)
+    {
+        Edge e = tree_[r];
+        tree[vertices[r]] = Edge { vertices[e.through], vertices[e.to] };
+    });
+    tree_.swap(tree);
+}
+
 template<class Value, class Vertex>
 template<class F>
 void
 nesoi::TripletMergeTree<Value, Vertex>::
 for_each_vertex(Vertex n, const F& f) const
 {
-    for_each(n, f);
+    for_each(n, f, threads_);
 }
 
 template<class Value, class Vertex>
+template<class Order>
 void
 nesoi::TripletMergeTree<Value, Vertex>::
-merge(Vertex u, Vertex v)
+merge(Vertex u, Vertex v, const Order& cmp)
 {
     if (cmp(u, v))
-        merge(v, v, u);
+        merge(v, v, u, cmp);
     else
-        merge(u, u, v);
+        merge(u, u, v, cmp);
 }
 
 template<class Value, class Vertex>
+template<class Order>
 void
 nesoi::TripletMergeTree<Value, Vertex>::
-merge(Vertex u, Vertex s, Vertex v)
+merge(Vertex u, Vertex s, Vertex v, const Order& cmp)
 {
     while(true)
     {
-        u = representative(u, s);
-        v = representative(v, s);
+        u = walk(u, s, cmp);
+        v = walk(v, s, cmp);
         if (u == v)
             break;
 
@@ -146,27 +236,286 @@ traverse_persistence(const F& f) const
     }
 }
 
+template<class Value, class Vertex>
+std::vector<int64_t>
+nesoi::TripletMergeTree<Value, Vertex>::
+cluster_labels(Value k, std::vector<int64_t>* sizes) const
+{
+    // parent in the forest of the superlevel set
+    std::vector<AtomicIndex> parent(size());
+    for_each_vertex([this,&parent,k](Vertex u)
+    {
+        Edge sv = tree_[u];
+        if (value(u) < k)
+            parent[u] = -1;
+        else if (sv.to != u && value(sv.through) >= k && value(sv.to) >= k)
+            parent[u] = sv.to;
+        else
+            parent[u] = u;
+    });
+
+    // find the roots, halving the paths along the way; every shortcut points to an ancestor,
+    // so concurrent walks never see an inconsistent forest
+    std::vector<int64_t> labels(size());
+    for_each_vertex([&parent,&labels](Vertex u)
+    {
+        int64_t x = parent[u];
+        if (x >= 0)
+        {
+            int64_t p = parent[x];
+            while (p != x)
+            {
+                int64_t g = parent[p];
+                if (g != p)
+                    parent[x] = g;
+                x = g;
+                p = parent[x];
+            }
+        }
+        labels[u] = x;
+    });
+
+    if (sizes)
+    {
+        std::vector<AtomicIndex> counts(size());
+        for_each_vertex([&counts](Vertex u) { counts[u] = 0; });
+        for_each_vertex([&counts,&labels](Vertex u) { if (labels[u] >= 0) ++counts[labels[u]]; });
+
+        sizes->resize(size());
+        for_each_vertex([&counts,sizes](Vertex u) { (*sizes)[u] = counts[u]; });
+    }
+
+    return labels;
+}
+
 template<class Value, class Vertex>
 void
 nesoi::TripletMergeTree<Value, Vertex>::
-compute_mt(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const val_ptr, bool negate)
+sweep_clusters(const Value* thresholds, size_t count, std::vector<int64_t>* labels, ClusterEvents* events) const
 {
-    set_negate(negate);
+    bool ascending  = std::is_sorted(thresholds, thresholds + count),
+         descending = std::is_sorted(thresholds, thresholds + count, std::greater<Value>());
+    if (!ascending && !descending)
+        throw std::runtime_error("Thresholds must be sorted");
 
-    for(size_t v = 0; v < size(); ++v) {
-        add(v, val_ptr[v]);
+    // the edge out of u is in the superlevel sets of the thresholds up to its level
+    auto level = [this](Vertex u) { Edge sv = tree_[u]; return std::min(value(u), std::min(value(sv.through), value(sv.to))); };
+
+    std::vector<Vertex> vertices, edges;
+    vertices.reserve(size());
+    for (Vertex u = 0; u < size(); ++u)
+    {
+        vertices.push_back(u);
+        if ((*this)[u].to != u)
+            edges.push_back(u);
     }
-    if (labels) {
-        for(const auto& e : edges) {
-            Vertex u = std::get<0>(e), v = std::get<1>(e);
-            if (labels[u] == labels[v])
-                merge(u, v);
+    parallel_sort(vertices.begin(), vertices.end(), [this](Vertex u, Vertex v) { return value(u) > value(v); }, threads_);
+    parallel_sort(edges.begin(),    edges.end(),    [&level](Vertex u, Vertex v) { return level(u) > level(v); }, threads_);
+
+    // union-find by size, with the top of every set, i.e., the root of its forest, as its label
+    std::vector<Vertex> parent(size()), top(size());
+    std::vector<size_t> set_size(size(), 1);
+    for_each_vertex([&parent,&top](Vertex u) { parent[u] = top[u] = u; });
+
+    auto find = [&parent](Vertex u)
+    {
+        while (parent[u] != u)
+        {
+            parent[u] = parent[parent[u]];
+            u = parent[u];
         }
-    } else {
-        for(const auto& e : edges)
-            merge(std::get<0>(e), std::get<1>(e));
+        return u;
+    };
+
+    if (labels)
+        labels->resize(count * size());
+
+    size_t v = 0, e = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t t = ascending ? count - 1 - i : i;
+        Value  k = thresholds[t];
+
+        for (; v < vertices.size() && value(vertices[v]) >= k; ++v)
+            if (events)
+            {
+                events->threshold.push_back(t);
+                events->from.push_back(vertices[v]);
+                events->to.push_back(vertices[v]);
+            }
+
+        for (; e < edges.size() && level(edges[e]) >= k; ++e)
+        {
+            Vertex u = edges[e],
+                   a = find(u),
+                   b = find((*this)[u].to),
+                   w = top[b];
+            if (events)
+            {
+                events->threshold.push_back(t);
+                events->from.push_back(top[a]);
+                events->to.push_back(w);
+            }
+
+            if (set_size[a] > set_size[b])
+                std::swap(a, b);
+            parent[a]    = b;
+            set_size[b] += set_size[a];
+            top[b]       = w;
+        }
+
+        // union by size keeps the paths short, so they are followed without compression, in parallel
+        if (labels)
+        {
+            int64_t* row = &(*labels)[t * size()];
+            for_each_vertex([this,row,k,&parent,&top](Vertex u)
+            {
+                if (value(u) < k)
+                {
+                    row[u] = -1;
+                    return;
+                }
+                Vertex x = u;
+                while (parent[x] != x)
+                    x = parent[x];
+                row[u] = top[x];
+            });
+        }
+    }
+}
+
+template<class Value, class Vertex>
+std::vector<int64_t>
+nesoi::TripletMergeTree<Value, Vertex>::
+cluster_labels(const Value* thresholds, size_t count) const
+{
+    std::vector<int64_t> labels;
+    sweep_clusters(thresholds, count, &labels, nullptr);
+    return labels;
+}
+
+template<class Value, class Vertex>
+typename nesoi::TripletMergeTree<Value, Vertex>::ClusterEvents
+nesoi::TripletMergeTree<Value, Vertex>::
+cluster_events(const Value* thresholds, size_t count) const
+{
+    ClusterEvents events;
+    sweep_clusters(thresholds, count, nullptr, &events);
+    return events;
+}
+
+template<class Value, class Vertex>
+bool
+nesoi::TripletMergeTree<Value, Vertex>::
+interval(Vertex u, Value& birth, Value& death, Value& persistence) const
+{
+    Edge   sv = tree_[u];
+    Vertex s  = sv.through,
+           v  = sv.to;
+
+    birth = value(u);
+    if (u == v)
+    {
+        death       = 0;
+        persistence = birth;
+        return birth != 0;
+    } else if (u != s)
+    {
+        death       = value(s);
+        persistence = birth > death ? birth - death : death - birth;
+        return birth != death;
     }
-    repair();
+    return false;
+}
+
+template<class Value, class Vertex>
+typename nesoi::TripletMergeTree<Value, Vertex>::Intervals
+nesoi::TripletMergeTree<Value, Vertex>::
+persistence_intervals(bool sort, Value min_persistence) const
+{
+    // mark the vertices that start an interval, then gather them in parallel at their prefix-sum positions
+    std::vector<size_t> position(size() + 1, 0);
+    for_each_vertex([this,&position,min_persistence](Vertex u)
+    {
+        Value birth, death, persistence;
+        position[u + 1] = interval(u, birth, death, persistence) && persistence >= min_persistence;
+    });
+    for (Vertex u = 0; u < size(); ++u)
+        position[u + 1] += position[u];
+
+    size_t m = position[size()];
+    Intervals result;
+    result.births.resize(m);
+    result.deaths.resize(m);
+    result.persistence.resize(m);
+    result.vertices.resize(m);
+    for_each_vertex([this,&position,&result](Vertex u)
+    {
+        size_t i = position[u];
+        if (position[u + 1] == i)
+            return;
+        interval(u, result.births[i], result.deaths[i], result.persistence[i]);
+        result.vertices[i] = u;
+    });
+
+    if (!sort)
+        return result;
+
+    std::vector<size_t> order(m);
+    for (size_t i = 0; i < m; ++i)
+        order[i] = i;
+    // persistence compared in double precision, so that float values order the way they do in Python
+    auto key = [this,&result](size_t i) -> std::tuple<double, Value, Value, Value, Vertex>
+    {
+        Vertex u = result.vertices[i],
+               v = (*this)[u].to;
+        double persistence = u == v ? double(result.births[i]) : std::abs(double(result.births[i]) - double(result.deaths[i]));
+        return std::make_tuple(persistence, result.births[i], result.deaths[i], value(v), u);
+    };
+    parallel_sort(order.begin(), order.end(), [&key](size_t i, size_t j) { return key(j) < key(i); }, threads_);
+
+    Intervals sorted;
+    sorted.births.resize(m);
+    sorted.deaths.resize(m);
+    sorted.persistence.resize(m);
+    sorted.vertices.resize(m);
+    for_each(m, [&sorted,&result,&order](size_t i)
+    {
+        size_t j = order[i];
+        sorted.births[i]      = result.births[j];
+        sorted.deaths[i]      = result.deaths[j];
+        sorted.persistence[i] = result.persistence[j];
+        sorted.vertices[i]    = result.vertices[j];
+    }, threads_);
+    return sorted;
+}
+
+template<class Value, class Vertex>
+template<class Edges>
+void
+nesoi::TripletMergeTree<Value, Vertex>::
+compute_mt(const Edges& edges, const int64_t* const labels, const Value* const val_ptr, bool negate)
+{
+    set_negate(negate);
+
+    for_each_vertex([this,val_ptr](Vertex v) { add(v, val_ptr[v]); });
+
+    merge_edges(EdgeList<Edges> { edges, labels, threads_ });
+}
+
+template<class Value, class Vertex>
+void
+nesoi::TripletMergeTree<Value, Vertex>::
+compute_mt(const Grid& grid, const int64_t* const labels, const Value* const val_ptr, bool negate)
+{
+    if (grid.size() != size())
+        throw std::runtime_error("Grid has " + std::to_string(grid.size()) + " vertices, merge tree has " + std::to_string(size()));
+
+    set_negate(negate);
+
+    for_each_vertex([this,val_ptr](Vertex v) { add(v, val_ptr[v]); });
+
+    merge_edges(GridEdges { grid, labels, threads_ });
 }
 
 
@@ -291,10 +640,11 @@ simplification_repr(Vertex u, Value epsilon, bool squash_root)
 
 
 template<class Value, class Vertex>
+template<class Edges>
 typename nesoi::TripletMergeTree<Value, Vertex>::
 Function
 nesoi::TripletMergeTree<Value, Vertex>::
-simplify(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* labels, const Value* const val_ptr, Value epsilon, bool negate, bool squash_root)
+simplify(const Edges& edges, const int64_t* labels, const Value* const val_ptr, Value epsilon, bool negate, bool squash_root)
 {
 
     if (squash_root && !negate) {
@@ -326,10 +676,11 @@ simplify(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* lab
 }
 
 template<class Value, class Vertex>
+template<class Edges>
 typename nesoi::TripletMergeTree<Value, Vertex>::
 Function
 nesoi::TripletMergeTree<Value, Vertex>::
-simplify(const std::vector<std::tuple<Vertex,Vertex>>& edges, const Value* const val_ptr, Value epsilon, Value level_value, bool negate)
+simplify(const Edges& edges, const Value* const val_ptr, Value epsilon, Value level_value, bool negate)
 {
     set_negate(negate);
 
@@ -348,10 +699,11 @@ simplify(const std::vector<std::tuple<Vertex,Vertex>>& edges, const Value* const
         //Diagram     noisy_part_of_diagram(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const values, Value epsilon, bool negate);
 
 template<class Value, class Vertex>
+template<class Edges>
 typename nesoi::TripletMergeTree<Value, Vertex>::
 Diagram
 nesoi::TripletMergeTree<Value, Vertex>::
-diagram(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels, const Value* const val_ptr, bool negate, bool squash_root)
+diagram(const Edges& edges, const int64_t* const labels, const Value* const val_ptr, bool negate, bool squash_root)
 {
     if (squash_root && !negate) {
         throw std::runtime_error("negate=false and squash_root=true");
@@ -381,10 +733,11 @@ diagram(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* cons
 
 
 template<class Value, class Vertex>
+template<class Edges>
 typename nesoi::TripletMergeTree<Value, Vertex>::
 Pairings
 nesoi::TripletMergeTree<Value, Vertex>::
-pairings(const std::vector<std::tuple<Vertex,Vertex>>& edges,
+pairings(const Edges& edges,
                       const int64_t* const labels,
                       const Value* const val_ptr,
                       bool negate,
@@ -430,9 +783,10 @@ pairings(const std::vector<std::tuple<Vertex,Vertex>>& edges,
 }
 
 template<class Value, class Vertex>
+template<class Edges>
 size_t
 nesoi::TripletMergeTree<Value, Vertex>::
-n_components(const std::vector<std::tuple<Vertex,Vertex>>& edges, const int64_t* const labels)
+n_components(const Edges& edges, const int64_t* const labels)
 {
     std::vector<Value> values(size(), Value(0));
 